@@ -23,10 +23,17 @@
 #include <getopt.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <dvdcss/dvdcss.h>
 #include <dvdcss/version.h>
 
+#include "keycache.h"
+
 #define EX_SUCCESS 0
 #define EX_USAGE (~((~0)<<8))
 #define EX_OPEN (~((~0)<<7))
@@ -42,46 +49,66 @@
 const char *progname = PROGRAM_NAME;
 const char *progversion = PROGRAM_VERSION;
 char verbosity = 1;
+#define BATCH 512 /* sectors read and written at a time */
+#define MAP_SECTORS 8192 /* window of the mapping of the output file */
+int  dvdpos = -1; /* sector at which libdvdcss is positioned (-1: unknown) */
 
-/* readsector() return flags */
+/* readsectors() flags of each sector */
 #define READ_ERROR 1<<0
 #define READ_EOF 1<<1
 #define SCRAMBLED 1<<2
 #define DECRYPTED 1<<3
 #define FAILED_DECRYPTION 1<<5
 
-static int  readsector ( dvdcss_t, unsigned char *, const int );
+/* Sector range [start,end[ to be processed */
+typedef struct {
+	int start, end;
+} range_t;
+
+static int  addrange   ( range_t **, int *, const int, const int );
+static int  readranges ( const char *, range_t **, int * );
+static int  sortranges ( range_t *, int );
+static int  cmpranges  ( const void *, const void * );
+static int  readsectors( dvdcss_t, unsigned char *, const int, const int, int * );
+static int  decryptrun ( dvdcss_t, unsigned char *, const int, const int, int * );
 static int  isscrambled( const unsigned char * );
-static int  dumpsector ( unsigned char *, FILE * );
+static int  getkey     ( dvdcss_t, const int );
+static int  dumpsectors( unsigned char *, const int, FILE * );
+static unsigned char *mapwindow( FILE *, unsigned char *, const int );
 static int  printe     ( const char, const char *, ... );
 
 static void usage( )
 {
 	fprintf( stderr, "Usage:\n" );
 	fprintf( stderr, "\t%s -V\n", progname );
-	fprintf( stderr, "\t%s [-v|-q] [-e] [-o <out_file> [-a]] <file> [<start_sect> [<end_sect>]]\n",
+	fprintf( stderr, "\t%s [-v|-q] [-e] [-o <out_file> [-a|-M]] [-K <cache_dir>] <file> [<start_sect> [<end_sect>]]\n",
 	  progname );
-	fprintf( stderr, "\t%s [-v|-q] -k <file> [<start_sect>]\n", progname );
+	fprintf( stderr, "\t%s [-v|-q] [-e] [-o <out_file> [-a|-M]] [-K <cache_dir>] [-R <range_file>] <file>\n\t\t[<start_sect> <end_sect>]...\n",
+	  progname );
+	fprintf( stderr, "\t%s [-v|-q] [-K <cache_dir>] -k <file> [<start_sect>]\n", progname );
 }
 
 int main( int argc, char *argv[] )
 {
 	int            status = EX_SUCCESS;
-	const char    *dvdfile, *outfile = NULL;
+	const char    *dvdfile, *outfile = NULL, *cachedir = NULL, *rangefile = NULL;
 	dvdcss_t       dvdcss;
 	FILE          *out = stdout;
 	const char    *outfile_mode = "w+";
-	unsigned char  data[ DVDCSS_BLOCK_SIZE * 2 ];
-	unsigned char *buffer;
+	static unsigned char data[ DVDCSS_BLOCK_SIZE * (BATCH+1) ];
+	unsigned char *buffer, *window = NULL;
 	unsigned int   sector = 0, end = INT_MAX;
-	int            n_processed = 0, n_scrambled = 0, n_undecrypted = 0;
-	int            rc;
+	range_t       *ranges = NULL;
+	int            n_ranges = 0, r;
+	int            n_processed = 0, n_scrambled = 0, n_undecrypted = 0, n_mapped = 0;
+	int            flags[ BATCH+1 ];
+	int            rc, n, i;
 
 	/* Options */
-	char b_noeof = 0, b_keyonly = 0;
+	char b_noeof = 0, b_keyonly = 0, b_mmap = 0, b_eof = 0;
 	extern int optind;
 	extern char *optarg;
-	while( (rc = getopt( argc, argv, "qveo:akV" )) != -1 )
+	while( (rc = getopt( argc, argv, "qveo:aMkK:R:V" )) != -1 )
 		switch( (char)rc )
 		{
 		case 'q':
@@ -99,9 +126,18 @@ int main( int argc, char *argv[] )
 		case 'a':
 			outfile_mode = "a+";
 			break;
+		case 'M':
+			b_mmap = 1;
+			break;
 		case 'k':
 			b_keyonly = 1;
 			break;
+		case 'K':
+			cachedir = optarg;
+			break;
+		case 'R':
+			rangefile = optarg;
+			break;
 		case 'V':
 			printf( "%s version %s (libdvdcss version %s)\n", progname, progversion, DVDCSS_VERSION_STRING);
 			exit( EX_SUCCESS );
@@ -115,7 +151,8 @@ int main( int argc, char *argv[] )
 	argv += optind;
 
 	/* Command line args */
-	if( argc < 1 || argc > 3 || (b_keyonly && argc > 2) )
+	if( argc < 1 || (argc > 3 && argc % 2 == 0) || (b_keyonly && (argc > 2 || rangefile))
+	    || (b_mmap && (! outfile || outfile_mode[0] == 'a')) )
 	{
 		printe( 1, "syntax error" );
 		usage( );
@@ -125,8 +162,30 @@ int main( int argc, char *argv[] )
 	if( argc >= 2 ) sector = (int)strtol( argv[1], (char **)NULL, 0 );
 	if( argc >= 3 ) end = (int)strtol( argv[2], (char **)NULL, 0 );
 
+	/* Sector ranges, processed in increasing order */
+	if( (argc >= 2 || ! rangefile) && ! addrange( &ranges, &n_ranges, sector, end ) )
+		exit( EX_IO );
+	for( i = 3; i+1 < argc; i += 2 )
+		if( ! addrange( &ranges, &n_ranges, (int)strtol( argv[i], (char **)NULL, 0 ),
+		                (int)strtol( argv[i+1], (char **)NULL, 0 ) ) )
+			exit( EX_IO );
+	if( rangefile && ! readranges( rangefile, &ranges, &n_ranges ) )
+		exit( EX_USAGE );
+	n_ranges = sortranges( ranges, n_ranges );
+	if( n_ranges == 0 )
+	{
+		printe( 1, "no sector to process" );
+		exit( EX_USAGE );
+	}
+	sector = ranges[0].start;
+	printe( 2, "%d sector ranges", n_ranges );
+
 	/* Initialize libdvdcss */
 	printe( 2, "%s version %s (libdvdcss version %s)", progname, progversion, DVDCSS_VERSION_STRING);
+	if( cachedir && opencache( cachedir, dvdfile ) < 0 )
+		printe( 1, "no key cache (%s)", strerror( errno ) );
+	else if( cachedir )
+		printe( 3, "key cache %s", keycache );
 	dvdcss = dvdcss_open( (char *)dvdfile );
 	if( dvdcss == NULL )
 	{
@@ -136,13 +195,14 @@ int main( int argc, char *argv[] )
 
 	/* Try to get a key */
 	printe( 2, "trying to obtain the title key at sector %d", sector );
-	rc = dvdcss_seek( dvdcss, sector, DVDCSS_SEEK_KEY );
+	rc = getkey( dvdcss, sector );
 	if( rc < 0 )
 	{
 		printe( 1, "getting the title key failed (%s)",
 		  dvdcss_error( dvdcss ) );
 		exit( status | EX_KEY );
 	}
+	dvdpos = rc;
 	if( b_keyonly ) goto CLOSEDVD_EXIT;
 
 	/* Open the output file */
@@ -161,37 +221,87 @@ int main( int argc, char *argv[] )
 	buffer = data + DVDCSS_BLOCK_SIZE
 	              - ((long int)data & (DVDCSS_BLOCK_SIZE-1));
 
-	for( ; sector < end; sector++ )
+	for( r = 0; r < n_ranges; r++ )
 	{
-		/* Read decrypted */
-		rc = readsector( dvdcss, buffer, sector );
-
-		/* Check & Count */
-		if( rc & READ_EOF )
-		{
-			printe( 2, "stop reading before sector %d", sector );
-			break;
-		}
-		if( rc & READ_ERROR )
+		/* The title key of the first range is already known; libdvdcss
+		 * keeps the keys it has found, so a range in a known title does not
+		 * need a new search */
+		sector = ranges[r].start;
+		end = ranges[r].end;
+		if( r > 0 )
 		{
-			printe( 1, "sect %d: read error; aborting", sector );
-			status |= EX_IO;
-			break;
+			printe( 2, "sectors %d-%d", sector, end );
+			rc = getkey( dvdcss, sector );
+			if( rc < 0 )
+			{
+				printe( 1, "sect %d: getting the title key failed (%s)",
+				  sector, dvdcss_error( dvdcss ) );
+				status |= EX_KEY;
+				break;
+			}
+			dvdpos = rc;
 		}
-		n_processed++;
-		if( rc & SCRAMBLED )
+
+		while( sector < end )
 		{
-			n_scrambled++;
-			if( ! (rc & DECRYPTED) )
-				n_undecrypted++;
-		}
+			/* Read decrypted, straight into the output file if it is mapped */
+			n = end - sector < BATCH ? end - sector : BATCH;
+			if( b_mmap )
+			{
+				if( ! window || n_mapped == MAP_SECTORS )
+				{
+					window = mapwindow( out, window, n_processed );
+					if( ! window )
+					{
+						status |= EX_IO;
+						break;
+					}
+					n_mapped = 0;
+				}
+				if( n > MAP_SECTORS - n_mapped ) n = MAP_SECTORS - n_mapped;
+				buffer = window + n_mapped * DVDCSS_BLOCK_SIZE;
+				n_mapped += n;
+			}
+			n = readsectors( dvdcss, buffer, sector, n, flags );
 
-		/* Process the sector */
-		if( ! dumpsector( buffer, out ) ) {
-			printe( 1, "sect %d: writing failed; aborting", sector );
-			status |= EX_IO;
-			break;
-		};
+			/* Write the sectors read in one go; the sector that could not be
+			 * written is the last one counted */
+			rc = b_mmap ? n : dumpsectors( buffer, n, out );
+			if( rc < n )
+			{
+				printe( 1, "sect %d: writing failed; aborting", sector + rc );
+				status |= EX_IO;
+				n = rc + 1;
+			}
+
+			/* Count */
+			for( i = 0; i < n; i++, sector++ )
+			{
+				n_processed++;
+				if( flags[i] & SCRAMBLED )
+				{
+					n_scrambled++;
+					if( ! (flags[i] & DECRYPTED) )
+						n_undecrypted++;
+				}
+			}
+			if( status & EX_IO ) break;
+
+			/* Check */
+			if( flags[n] & READ_EOF )
+			{
+				printe( 2, "stop reading before sector %d", sector );
+				b_eof = 1;
+				break;
+			}
+			if( flags[n] & READ_ERROR )
+			{
+				printe( 1, "sect %d: read error; aborting", sector );
+				status |= EX_IO;
+				break;
+			}
+		}
+		if( status || b_eof ) break;
 	}
 
 	/* Summary & Return status */
@@ -205,6 +315,16 @@ int main( int argc, char *argv[] )
 	if( n_undecrypted > 0 ) status |= EX_UNDECRYPTED;
 
 	/* Close & Exit */
+	if( b_mmap )
+	{
+		/* Cut the last window at the last sector processed */
+		if( window ) mapwindow( out, window, -1 );
+		if( ftruncate( fileno( out ), (off_t)n_processed * DVDCSS_BLOCK_SIZE ) < 0 )
+		{
+			printe( 1, "truncating of the output file failed (%s)", strerror( errno ) );
+			status |= EX_IO;
+		}
+	}
 	if( fflush( out ) != 0 )
 	{
 		printe( 1, "flushing of the output failed (%s)", strerror( errno ) );
@@ -220,70 +340,230 @@ CLOSEDVD_EXIT:
 	exit( status );
 }
 
-/* Read a sector; read decrypted again if it seems crypted */
-static int readsector( dvdcss_t dvdcss, unsigned char *buffer, const int sector )
+/* Append the range [start,end[ to the array ranges of count elements */
+static int addrange( range_t **ranges, int *count, const int start, const int end )
 {
-	int rc, flags = 0;
+	range_t *new;
 
-	/* Seek at sector sector and read one sector */
-	rc = dvdcss_seek( dvdcss, sector, DVDCSS_NOFLAGS );
+	if( (*count & (*count - 1)) == 0 )
+	{
+		/* Double the allocation at each power of 2 */
+		new = realloc( *ranges, (*count ? 2 * *count : 1) * sizeof( range_t ) );
+		if( new == NULL )
+		{
+			printe( 1, "memory allocation failed" );
+			return 0;
+		}
+		*ranges = new;
+	}
+	(*ranges)[*count].start = start;
+	(*ranges)[*count].end = end;
+	(*count)++;
+	return 1;
+}
+
+/* Read the ranges listed in rangefile (stdin if "-"), one "start end" pair
+ * per line; blank lines and lines starting with # are ignored */
+static int readranges( const char *rangefile, range_t **ranges, int *count )
+{
+	FILE *list;
+	char line[256], *p, *q;
+	int  start, end, n = 0, rc = 1;
+
+	list = strcmp( rangefile, "-" ) ? fopen( rangefile, "r" ) : stdin;
+	if( list == NULL )
+	{
+		printe( 1, "opening of the range file (%s) failed (%s)",
+		  rangefile, strerror( errno ) );
+		return 0;
+	}
+	while( rc && fgets( line, sizeof( line ), list ) )
+	{
+		n++;
+		for( p = line; *p == ' ' || *p == '\t'; p++ );
+		if( *p == '#' || *p == '\n' || *p == '\0' ) continue;
+		start = (int)strtol( p, &q, 0 );
+		if( q == p )
+			rc = 0;
+		p = q;
+		end = (int)strtol( p, &q, 0 );
+		if( q == p )
+			rc = 0;
+		if( ! rc )
+			printe( 1, "%s: line %d: invalid range", rangefile, n );
+		else
+			rc = addrange( ranges, count, start, end );
+	}
+	if( ferror( list ) )
+	{
+		printe( 1, "reading of the range file (%s) failed (%s)",
+		  rangefile, strerror( errno ) );
+		rc = 0;
+	}
+	if( list != stdin )
+		fclose( list );
+	return rc;
+}
+
+/* Sort the ranges, drop the empty ones and merge the overlapping ones; return
+ * the new number of ranges */
+/* Adjacent ranges are not merged, as they may belong to different titles
+ * (each range gets the title key at its start). */
+static int sortranges( range_t *ranges, int count )
+{
+	int i, n;
+
+	qsort( ranges, count, sizeof( range_t ), cmpranges );
+	for( i = n = 0; i < count; i++ )
+	{
+		if( ranges[i].start < 0 || ranges[i].end <= ranges[i].start )
+			continue;
+		if( n > 0 && ranges[i].start < ranges[n-1].end )
+		{
+			if( ranges[i].end > ranges[n-1].end )
+				ranges[n-1].end = ranges[i].end;
+			continue;
+		}
+		ranges[n++] = ranges[i];
+	}
+	return n;
+}
+
+static int cmpranges( const void *a, const void *b )
+{
+	const range_t *ra = a, *rb = b;
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* Read up to n sectors; read decrypted again the runs of sectors that seem
+ * crypted; return the number of sectors read, the flags of each sector being
+ * set in flags[0] to flags[n-1] and the reason of a short count in the flags
+ * of the sector that could not be read */
+static int readsectors( dvdcss_t dvdcss, unsigned char *buffer, const int sector,
+                        const int n, int *flags )
+{
+	int rc, i, j;
+
+	for( i = 0; i <= n; i++ )
+		flags[i] = 0;
+
+	/* Seek at sector sector (unless the previous read stopped there) and
+	 * read n sectors as they are */
+	rc = dvdpos == sector ? sector : dvdcss_seek( dvdcss, sector, DVDCSS_NOFLAGS );
 	if( rc < 0 )
 	{
 		printe( 1, "sect %d: seek failed (%s)", sector, dvdcss_error( dvdcss ) );
-		return flags | READ_ERROR;
+		flags[0] |= READ_ERROR;
+		dvdpos = -1;
+		return 0;
+	}
+	rc = dvdcss_read( dvdcss, buffer, n, DVDCSS_NOFLAGS );
+	dvdpos = rc < 0 ? -1 : sector + rc;
+	if( rc < 0 && n > 1 )
+	{
+		/* Locate the faulty sector */
+		for( i = 0; i < n; i++ )
+			if( readsectors( dvdcss, buffer + i * DVDCSS_BLOCK_SIZE,
+			                 sector + i, 1, flags + i ) < 1 )
+				break;
+		return i;
 	}
-	rc = dvdcss_read( dvdcss, buffer, 1, DVDCSS_NOFLAGS );
 	if( rc < 0 )
 	{
 		printe( 1, "sect %d: read failed (%s)", sector, dvdcss_error( dvdcss ) );
-		return flags | READ_ERROR;
+		flags[0] |= READ_ERROR;
+		return 0;
 	}
-	if( rc == 0 )
+	if( rc < n )
 	{
-		printe( 1, "sect %d: EOF", sector );
-		return flags | READ_EOF;
+		printe( 1, "sect %d: EOF", sector + rc );
+		flags[rc] |= READ_EOF;
 	}
 
-	if( ! isscrambled( buffer ) /* Check if sector is encrypted */ )
-		printe( 3, "sect %d: not crypted", sector );
-	else
+	/* Only the runs of scrambled sectors are decrypted */
+	for( i = 0; i < rc; i = j )
 	{
-		printe( 3, "sect %d: crypted", sector );
-		flags |= SCRAMBLED;
-
-		/* Seek at sector sector and try to decrypt sector */
-		rc = dvdcss_seek( dvdcss, sector, DVDCSS_NOFLAGS );
-		if( rc < 0 )
-		{
-			printe( 1, "sect %d: seek failed (%s)",
-			  sector, dvdcss_error( dvdcss ) );
-			return flags;
-		}
-		rc = dvdcss_read( dvdcss, buffer, 1, DVDCSS_READ_DECRYPT );
-		  /* Warning: A failure to decrypt is not considered an error in
-		   * libdvdcss 1.2.12 */
-		if( rc != 1 )
+		if( ! isscrambled( buffer + i * DVDCSS_BLOCK_SIZE ) )
 		{
-			printe( 2, "sect %d: read (decrypted) failed (%s)",
-			  sector, dvdcss_error( dvdcss ) );
-			return flags;
+			printe( 3, "sect %d: not crypted", sector + i );
+			j = i + 1;
+			continue;
 		}
+		for( j = i + 1; j < rc; j++ )
+			if( ! isscrambled( buffer + j * DVDCSS_BLOCK_SIZE ) )
+				break;
+		decryptrun( dvdcss, buffer + i * DVDCSS_BLOCK_SIZE, sector + i, j - i,
+		            flags + i );
+	}
+
+	return rc;
+}
+
+/* Read n crypted sectors again, decrypted, and check them */
+static int decryptrun( dvdcss_t dvdcss, unsigned char *buffer, const int sector,
+                       const int n, int *flags )
+{
+	int rc, i;
 
-		if( isscrambled( buffer ) /* Check if the decryption really succeeded */ )
+	for( i = 0; i < n; i++ )
+	{
+		printe( 3, "sect %d: crypted", sector + i );
+		flags[i] |= SCRAMBLED;
+	}
+
+	/* Seek at sector sector and try to decrypt the sectors */
+	rc = dvdcss_seek( dvdcss, sector, DVDCSS_NOFLAGS );
+	if( rc < 0 )
+	{
+		printe( 1, "sect %d: seek failed (%s)",
+		  sector, dvdcss_error( dvdcss ) );
+		dvdpos = -1;
+		return 0;
+	}
+	rc = dvdcss_read( dvdcss, buffer, n, DVDCSS_READ_DECRYPT );
+	dvdpos = rc < 0 ? -1 : sector + rc;
+	  /* Warning: A failure to decrypt is not considered an error in
+	   * libdvdcss 1.2.12 */
+	if( rc != n )
+	{
+		printe( 2, "sect %d: read (decrypted) failed (%s)",
+		  sector, dvdcss_error( dvdcss ) );
+		return 0;
+	}
+
+	for( i = 0; i < n; i++ )
+		if( isscrambled( buffer + i * DVDCSS_BLOCK_SIZE )
+		    /* Check if the decryption really succeeded */ )
 		{
 			/* Probably a bug in libdvdcss not to have given an error earlier */
 			printe( 1, "sect %d: still apparently crypted after decryption",
-			  sector );
-			flags |= FAILED_DECRYPTION;
+			  sector + i );
+			flags[i] |= FAILED_DECRYPTION;
 		}
 		else
 		{
-			printe( 3, "sect %d: decrypted", sector );
-			flags |= DECRYPTED;
+			printe( 3, "sect %d: decrypted", sector + i );
+			flags[i] |= DECRYPTED;
 		}
-	}
 
-	return flags;
+	return n;
+}
+
+/* Get the title key at sector through the key cache, reporting its use */
+static int getkey( dvdcss_t dvdcss, const int sector )
+{
+	int    cached = keys_cached, rc;
+	double saved = keys_saved, t;
+
+	rc = seekkey( dvdcss, sector, &t );
+	if( rc < 0 || keycache == NULL )
+		return rc;
+
+	if( keys_cached > cached )
+		printe( 2, "title key found in the cache (%.1f s saved)", keys_saved - saved );
+	else
+		printe( 2, "title key searched (%.1f s)", t );
+	return rc;
 }
 
 /* Check if a sector is scrambled */
@@ -292,18 +572,53 @@ static int isscrambled( const unsigned char *buffer )
 	return buffer[ 0x14 ] & 0x30;
 }
 
+/* Unmap the current window of the output file (if any) and map the next one,
+ * of MAP_SECTORS sectors starting at sector position sector of the file,
+ * extending it as needed; only unmap if sector is negative */
+/* The blocks of a window are allocated before it is mapped and the window is
+ * written back before it is unmapped, so that a full disk is an error rather
+ * than a SIGBUS. */
+static unsigned char *mapwindow( FILE *out, unsigned char *window, const int sector )
+{
+	size_t len = (size_t)MAP_SECTORS * DVDCSS_BLOCK_SIZE;
+	off_t  offset = (off_t)sector * DVDCSS_BLOCK_SIZE;
+	int    rc;
+
+	if( window && (msync( window, len, MS_SYNC ) < 0 || munmap( window, len ) < 0) )
+	{
+		printe( 1, "write error (%s)", strerror( errno ) );
+		return NULL;
+	}
+	if( sector < 0 ) return NULL;
+
+	if( (rc = posix_fallocate( fileno( out ), offset, len )) != 0 )
+	{
+		printe( 1, "extending of the output file failed (%s)", strerror( rc ) );
+		return NULL;
+	}
+	window = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno( out ), offset );
+	if( window == MAP_FAILED )
+	{
+		printe( 1, "mapping of the output file failed (%s)", strerror( errno ) );
+		return NULL;
+	}
+	madvise( window, len, MADV_SEQUENTIAL );
+
+	return window;
+}
+
 /* Dump the sector on stdout */
-static int dumpsector( unsigned char *buffer, FILE *out )
+/* Write n sectors; return the number of sectors written */
+static int dumpsectors( unsigned char *buffer, const int n, FILE *out )
 {
-	size_t n;
-	n = fwrite( (void *)buffer, DVDCSS_BLOCK_SIZE, 1, out );
+	size_t rc;
+	rc = fwrite( (void *)buffer, DVDCSS_BLOCK_SIZE, n, out );
 	if( ferror( out ) )
 	{
 		printe( 1, "write error (%s)", strerror( errno ) );
 		clearerr( out );
-		return 0;
 	}
-	return (n == 1);
+	return (int)rc;
 }
 
 /* Print a line on stderr preceded by the program name */
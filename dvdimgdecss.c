@@ -13,25 +13,54 @@
  *   with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#	define _GNU_SOURCE /* fallocate(), copy_file_range() */
+#endif
 #if HAVE_CONFIG_H
 #   include "config.h"
+#elif defined( __linux__ )
+#	define HAVE_COPY_FILE_RANGE 1
+#	define HAVE_SENDFILE 1
+#	define HAVE_FALLOCATE 1
+#	define HAVE_POSIX_FADVISE 1
+#	define HAVE_LINUX_IO_URING_H 1
 #endif
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#if HAVE_SENDFILE
+#	include <sys/sendfile.h>
+#endif
+#include <sys/mman.h>
+#if HAVE_LINUX_IO_URING_H
+#	include <linux/io_uring.h>
+#	include <sys/syscall.h>
+#endif
+#if defined( __GNUC__ ) && defined( __x86_64__ )
+#	include <nmmintrin.h> /* SSE 4.2 crc32 instruction */
+#	define HAVE_CRC32C_SSE42 1
+#endif
 
 #include <dvdread/dvd_reader.h>
 #include <dvdread/dvd_udf.h>
 #include <dvdcss/dvdcss.h>
 #include <dvdcss/version.h>
 
+#include "keycache.h"
+
 #define EX_SUCCESS 0
 #define EX_USAGE (~((~0)<<8))
 #define EX_OPEN (~((~0)<<7))
@@ -50,7 +79,47 @@ const char *progversion = PROGRAM_VERSION;
 char verbosity = 1;
 char dvdread_check = 0;
 char dvdread_decrypt = 0;
-#define TITLE_MAX 100
+#define TITLE_MAX 100 /* when the titles are searched by name */
+int  title_count = 0; /* size of the title table */
+#define BATCH_DEFAULT 256
+#define BATCH_MAX 32768
+int  batch = BATCH_DEFAULT; /* sectors per read/write call */
+#define RING_MAX 64
+int  ring_depth = 0; /* number of buffers of the reader/writer pipeline */
+#define JOBS_MAX 64
+#define CHUNK_SECTORS 8192
+int  jobs = 1; /* number of decryption workers */
+int  parallel = 1; /* DVDs copied at a time in batch mode */
+int  per_device = 1; /* of them read from the same device */
+char progress_off = 0;
+char sparse = 0;
+char sparse_punch = 0; /* the image had data before */
+long long sparse_bytes = 0; /* bytes of zero sectors not written */
+char delta = 0; /* only the sectors that differ from the image are written */
+long long delta_bytes = 0, delta_same = 0; /* bytes rewritten, left as they were */
+long long undecrypted = 0; /* sectors still scrambled after decryption */
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+FILE *journal = NULL; /* completed chunks, for resuming */
+int  journal_undo = -1; /* original data of the chunks being decrypted in place */
+char inplace = 0;
+char mapformat = 0; /* 't'ext or 'j'son */
+int  dvdfd = -1; /* the DVD if it is an image file */
+int  kernel_copy = 0; /* 1: copy_file_range(), 2: sendfile(), 0: buffers */
+pthread_mutex_t sendfile_lock = PTHREAD_MUTEX_INITIALIZER;
+char direct = 0; /* the image is written with O_DIRECT */
+#define BUFFER_ALIGN 4096 /* of the buffers, for O_DIRECT */
+#define URING_MAX 64
+int  uring_depth = 0; /* number of writes in flight with io_uring */
+#define MAP_SECTORS 8192 /* window of the mappings */
+char streaming = 0; /* the image is written in sector order to a pipe */
+off_t stream_pos = 0; /* bytes of the image written to the pipe */
+char msg_stderr = 0; /* stdout is the image */
+char map_io = 0; /* the image (and the DVD image file) are mapped */
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+FILE *stats = NULL; /* metrics, one JSON object per line */
+char *badmapfile = NULL; /* unreadable sectors, for a later pass */
+int  read_retries = 2; /* of an unreadable sector */
+double read_budget = 30; /* seconds spent on a region with read errors */
 
 /* Make an array of an enum so as to iterate */
 #define DOMAIN_MAX 4
@@ -83,6 +152,15 @@ typedef struct {
 	int size;
 } block_t;
 
+/* A copy of the batch mode */
+typedef struct {
+	char            *dvdfile, *imgfile;
+	dev_t           device; /* holding the DVD */
+	pid_t           pid; /* 0 before it is started, -1 after it has exited */
+	int             status;
+	struct timespec start;
+} job_t;
+
 typedef struct {
 	block_t ifo, menu, vob, bup;
 } titleblocks_t;
@@ -104,47 +182,296 @@ block_t *domainblock( titleblocks_t *tblocks, dvd_read_domain_t domain )
 	}
 }
 
-typedef struct blockl {
-	block_t  block;
-	struct blockl *tail;
-} *blockl_t;
+/* Sizes of the title/domains according to libdvdread (-1 if it does not find
+ * them), statted once for the checks */
+titleblocks_t dvdread_blocks[TITLE_MAX];
+
+/* Little endian fields of the UDF descriptors */
+static int le16( const unsigned char *p )
+{
+	return p[0] | p[1] << 8;
+}
+
+static int le32( const unsigned char *p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+/* Ring of buffers between the reader thread and the writer of a block */
+typedef struct {
+	unsigned char *data;
+	int           lb, n, count; /* count < n if the read failed */
+} slot_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	slot_t          *slots;
+	int             head, used, stop;
+	/* Reader arguments */
+	dvd_file_t      *file;
+	dvdcss_t        dvdcss;
+	int             lb, end;
+	int             read_flags;
+} ring_t;
+
+/* Submission and completion queues of an io_uring instance */
+typedef struct {
+	int      fd; /* -1 if io_uring is not available */
+#if HAVE_LINUX_IO_URING_H
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void     *sq_ring, *cq_ring;
+	size_t   sq_size, cq_size, sqes_size;
+#endif
+} uring_t;
+/* Read buffers and io_uring instance of copyblock(), set up on its first call
+ * and released at the end of the run */
+unsigned char *copy_buffer = NULL, *copy_compare = NULL;
+uring_t copy_uring = { .fd = -1 };
+
+/* SHA-256 computation */
+typedef struct {
+	uint32_t      state[8];
+	uint64_t      count; /* bytes */
+	unsigned char buf[64];
+} sha256_t;
+
+/* Digests of a part of an extent of the map (at most CHUNK_SECTORS sectors,
+ * cut from the start of the extent like the work of the workers), computed
+ * as its sectors are written in order */
+typedef struct {
+	int           start, size;
+	int           next; /* sector up to which it is hashed; -1 if broken */
+	uint32_t      crc;
+	sha256_t      sha;
+	unsigned char digest[32];
+} hashunit_t;
+
+struct {
+	hashunit_t *units;
+	int        count;
+} hashes = { NULL, 0 };
+
+/* Units of a manifest being checked by the verification workers */
+typedef struct {
+	pthread_mutex_t lock;
+	hashunit_t      *units;
+	int             count, next;
+	int             fd;
+	int             status;
+} verify_t;
+
+/* Part of a title/domain to be copied by a worker */
+typedef struct {
+	block_t extent; /* the whole title/domain */
+	int     lb, end; /* sector range in the extent */
+	int     decrypt;
+	int     gap; /* an ordinary block */
+	char    name[24];
+} work_t;
+
+/* Work list shared by the decryption workers */
+typedef struct {
+	pthread_mutex_t lock;
+	work_t          *items;
+	int             count, alloc, next;
+	const char      *dvdfile;
+	int             img;
+	int             status;
+	int             workers; /* number of started workers */
+} pool_t;
+
+/* Metrics: calls and bytes of each kind of I/O operation, and seconds spent
+ * in each phase (summed over the workers for the keys, titles and gaps) */
+enum { OP_READ, OP_SEEK, OP_WRITE, OP_COPY, OP_SYNC, OP_MAX };
+const char *opnames[OP_MAX] = { "read", "seek", "write", "copy", "sync" };
+enum { PH_OPEN, PH_LOCATE, PH_KEYS, PH_TITLES, PH_GAPS, PH_COPY, PH_CLOSE, PH_MAX };
+const char *phasenames[PH_MAX] = { "open", "locate", "keys", "titles", "gaps", "copy", "close" };
+struct {
+	struct timespec start;
+	long long       calls[OP_MAX], bytes[OP_MAX];
+	double          phases[PH_MAX];
+	double          last; /* time of the last progress line */
+	long long       last_bytes;
+} metrics;
+
+/* Sector ranges recorded in the journal, and the chunks that were being
+ * decrypted in place (by undo slot) */
+struct {
+	pthread_mutex_t lock;
+	block_t         *done;
+	int             count, alloc;
+	block_t         pending[JOBS_MAX];
+} journal_ranges = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, { { 0, 0 } } };
+
+/* Sector ranges that could not be read by this run, and those of the bad
+ * sector map of the previous run, which are the only ones retried */
+struct {
+	pthread_mutex_t lock;
+	block_t         *bad, *retry;
+	int             count, alloc, retry_count;
+	char            retrying;
+} badsectors = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, 0, 0 };
+
+/* Map of the DVD: its sector ranges in increasing order, each being a
+ * title/domain or an ordinary block (a gap between them) */
+#define GAP (-1) /* title of an ordinary block */
+typedef struct {
+	block_t           block;
+	int               title;
+	dvd_read_domain_t domain;
+} extent_t;
+
+typedef struct {
+	extent_t *extents;
+	int      count;
+} extmap_t;
 
 static void usage( )
 {
-	printf( "Usage:\n" );
-	printf( "\t%s -V\n", progname );
-	printf( "\t%s [-v|-q] [-c] <dvd>\n", progname );
-	printf( "\t%s [-v|-q] [-c|-C] <dvd> <out_file>\n", progname );
+	/* Not in the image written on stdout */
+	FILE *out = msg_stderr ? stderr : stdout;
+
+	fprintf( out, "Usage:\n" );
+	fprintf( out, "\t%s -V\n", progname );
+	fprintf( out, "\t%s [-v|-q] [-c] [-m text|json] <dvd>\n", progname );
+	fprintf( out, "\t%s [-v|-q] [-c|-C] [-s|-d|-M] [-D] [-r <journal>] [-e <bad_map> [-E <retries>[:<seconds>]]]\n\t\t[-K <cache_dir>] [-H <manifest>] [-m text|json] [-b <sectors>] [-p <buffers>|-u <depth>]\n\t\t[-j <workers>] [-S <fd>] <dvd> <out_file>\n",
+	  progname );
+	fprintf( out, "\t%s [-v|-q] [-c] -i [-r <journal>] [-K <cache_dir>] [-H <manifest>] [-b <sectors>] [-j <workers>]\n\t\t[-S <fd>] <dvd>\n",
+	  progname );
+	fprintf( out, "\t%s [-v|-q] -y <manifest> [-j <workers>] <file>\n", progname );
+	fprintf( out, "\t%s [-v|-q] [-c|-C] [-s|-d|-M] [-D] [-K <cache_dir>] [-b <sectors>] [-p <buffers>|-u <depth>]\n\t\t[-j <workers>] [-S <fd>] -B <job_list> [-J <jobs>[:<per_device>]]\n",
+	  progname );
 }
 
+static int  runbatch       ( const char *, char **, char ** );
+static void statjob        ( int, const job_t *, int, double );
+static void statstring     ( const char * );
 static int  dvdsize        ( const char * );
-static int  savetitleblocks( dvd_reader_t *, titleblocks_t (*)[TITLE_MAX] );
+static int  savetitleblocks( dvd_reader_t *, dvdcss_t, titleblocks_t ** );
+static int  scantitleblocks( dvd_reader_t *, dvdcss_t, titleblocks_t ** );
+static int  udffileblock   ( dvdcss_t, int, int, block_t * );
+static int  readsectors    ( dvdcss_t, int, int, unsigned char * );
+static int  seekdvd        ( dvdcss_t, int, int );
+static int  seekdvdkey     ( dvdcss_t, int );
 static int  fileblock      ( dvd_reader_t *, char *, block_t * );
-static int  removetitles   ( blockl_t, titleblocks_t [] );
-static int  removeblock    ( blockl_t, const block_t );
-static int  decrypttitles  ( dvd_reader_t *, dvdcss_t, int, titleblocks_t [] );
-static int  copyblocks     ( dvdcss_t, int, blockl_t );
+static int  mapextents     ( extmap_t *, titleblocks_t [], int );
+static int  cmpextents     ( const void *, const void * );
+static void printmap       ( const extmap_t *, int, int );
+static int  decrypttitles  ( dvd_reader_t *, dvdcss_t, int, titleblocks_t [],
+                             const extmap_t *, pool_t * );
+static int  copydomain     ( dvd_reader_t *, dvdcss_t, int, int, dvd_read_domain_t,
+                             block_t *, pool_t * );
+static int  countseeks     ( titleblocks_t [], const extmap_t * );
+static int  queueblock     ( pool_t *, block_t, int, int, const char * );
+static int  runworkers     ( pool_t * );
+static void *workerthread  ( void * );
 static int  copyblock      ( dvd_file_t *, dvdcss_t, int, block_t, const char * );
+static int  syncblock      ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, unsigned char *, const char * );
+static int  retryblocks    ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, unsigned char *, const char * );
+static int  recoverblocks  ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, unsigned char *, const char * );
+static int  recoverrange   ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, unsigned char *, const char *,
+                             const struct timespec * );
+static int  budgetspent    ( const struct timespec * );
+static int  giveupblocks   ( int, block_t, int, int, unsigned char *, unsigned char *,
+                             const char * );
+static int  mapblock       ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             const char * );
+static int  uringblock     ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, const char *, uring_t * );
+static int  pipeblock      ( dvd_file_t *, dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, unsigned char *, const char * );
+static int  inplaceblock   ( dvdcss_t, int, block_t, int, int, int,
+                             unsigned char *, const char * );
+static void *readerthread  ( void * );
+static int  readblocks     ( dvd_file_t *, dvdcss_t, int, int, int, unsigned char * );
+static int  writeblocks    ( int, const unsigned char *, int, int, unsigned char * );
+static int  writerun       ( int, const unsigned char *, int, int );
+static int  deltablocks    ( int, const unsigned char *, int, int, unsigned char * );
+static int  streamfill     ( int, off_t );
+static int  iszero         ( const unsigned char * );
+static int  isscrambled    ( const unsigned char * );
+static int  kernelcopy     ( int, int, int );
+static int  copymode       ( void );
+static void lowercopy      ( int );
+static int  preallocate    ( int, int );
+static size_t slotsize     ( void );
+static void uringopen      ( uring_t * );
+static void uringclose     ( uring_t * );
+static int  uringwrite     ( uring_t *, int, const struct iovec *, int, int );
+static int  uringwait      ( uring_t *, int * );
+static void uringdrain     ( uring_t *, int );
+static void dropcache      ( int, int );
 dvd_file_t *openfile       ( dvd_reader_t *, int, dvd_read_domain_t );
+static void statfiles      ( dvd_reader_t * );
+static int  openjournal    ( const char *, int );
+static int  removejournal  ( const char * );
+static int  journaldone    ( int, int );
+static int  journalmark    ( int, int, int );
+static int  journalbegin   ( int, int, int, const unsigned char * );
+static int  journalrestore ( int );
+static void markbad        ( int, int );
+static int  badoverlap     ( int, int );
+static int  openbadmap     ( const char *, int );
+static int  writebadmap    ( const char *, int );
+static int  cmpblocks      ( const void *, const void * );
+static int  makeunits      ( const extmap_t * );
+static hashunit_t *findunit( int );
+static void hashblocks     ( int, int, const unsigned char * );
+static void hashreset      ( int, int );
+static int  hashfile       ( int, hashunit_t *, unsigned char * );
+static int  writemanifest  ( const char *, const char *, const extmap_t *, int );
+static int  writedigest    ( FILE *, const char *, uint32_t, const unsigned char * );
+static int  verifymanifest ( const char *, const char * );
+static void *verifythread  ( void * );
+static int  parsedigest    ( const char *, uint32_t *, unsigned char * );
+static uint32_t crc32c     ( uint32_t, const unsigned char *, size_t );
+static uint32_t crc32ccombine( uint32_t, uint32_t, long long );
+static const uint32_t *crc32ctable( void );
+static void sha256init     ( sha256_t * );
+static void sha256update   ( sha256_t *, const unsigned char *, size_t );
+static void sha256final    ( sha256_t *, unsigned char * );
+static void sha256block    ( sha256_t *, const unsigned char * );
+static double statnow      ( void );
+static void statcount      ( int, int, long long );
+static void statphase      ( int, double );
+static void statextent     ( const char *, int, int, int, double );
+static void statsummary    ( int, int );
 static int  progress       ( const int );
+static int  percent        ( int, int );
 static int  printe         ( const char, const char *, ... );
 
 /* Main for a command line tool */
 int main( int argc, char *argv[] )
 {
-	char          *dvdfile, *imgfile = NULL;
+	char          *dvdfile, *imgfile = NULL, *journalfile = NULL, *cachedir = NULL;
+	char          *manifestfile = NULL, *verifyfile = NULL, *joblistfile = NULL;
+	char          *joblimits = NULL;
 	dvd_reader_t  *dvd;
 	dvdcss_t      dvdcss = NULL;
 	int           img;
-	titleblocks_t titles[TITLE_MAX];
-	struct blockl blocks;
-	int           rc, status = EX_SUCCESS;
+	titleblocks_t *titles = NULL;
+	extmap_t      map;
+	pool_t        pool, *ppool = NULL;
+	struct stat   imgstat;
+	struct timespec t0, t1;
+	double        t;
+	int           size, rc, status = EX_SUCCESS;
 
 	setvbuf( stdout, NULL, _IOLBF, BUFSIZ );
+	clock_gettime( CLOCK_MONOTONIC, &metrics.start );
 
 	/* Options */
 	extern int optind;
-	while( (rc = getopt( argc, argv, "qvcCV" )) != -1 )
+	extern char *optarg;
+	while( (rc = getopt( argc, argv, "qvcCsdMDir:e:E:K:H:y:m:b:p:u:j:B:J:S:V" )) != -1 )
 		switch( (char)rc ) {
 		case 'q':
 			verbosity--;
@@ -158,6 +485,105 @@ int main( int argc, char *argv[] )
 			dvdread_check = 1;
 			dvdread_decrypt = 1;
 			break;
+		case 's':
+			sparse = 1;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 'M':
+			map_io = 1;
+			break;
+		case 'D':
+			delta = 1;
+			break;
+		case 'i':
+			inplace = 1;
+			break;
+		case 'r':
+			journalfile = optarg;
+			break;
+		case 'e':
+			badmapfile = optarg;
+			break;
+		case 'E':
+			rc = sscanf( optarg, "%d:%lf", &read_retries, &read_budget );
+			if( rc < 1 || read_retries < 0 || read_budget <= 0 ) {
+				printe( 1, "invalid retries (retries[:seconds])\n" );
+				usage( );
+				exit( EX_USAGE );
+			}
+			break;
+		case 'K':
+			cachedir = optarg;
+			break;
+		case 'H':
+			manifestfile = optarg;
+			break;
+		case 'y':
+			verifyfile = optarg;
+			break;
+		case 'm':
+			if( strcmp( optarg, "text" ) && strcmp( optarg, "json" ) ) {
+				printe( 1, "invalid map format (text or json)\n" );
+				usage( );
+				exit( EX_USAGE );
+			}
+			mapformat = optarg[0];
+			break;
+		case 'b':
+			batch = (int)strtol( optarg, (char **)NULL, 0 );
+			if( batch < 1 || batch > BATCH_MAX ) {
+				printe( 1, "invalid batch size (1-%d sectors)\n", BATCH_MAX );
+				usage( );
+				exit( EX_USAGE );
+			}
+			break;
+		case 'p':
+			ring_depth = (int)strtol( optarg, (char **)NULL, 0 );
+			if( ring_depth < 0 || ring_depth == 1 || ring_depth > RING_MAX ) {
+				printe( 1, "invalid number of buffers (0 or 2-%d)\n", RING_MAX );
+				usage( );
+				exit( EX_USAGE );
+			}
+			break;
+		case 'u':
+			uring_depth = (int)strtol( optarg, (char **)NULL, 0 );
+			if( uring_depth < 0 || uring_depth == 1 || uring_depth > URING_MAX ) {
+				printe( 1, "invalid queue depth (0 or 2-%d)\n", URING_MAX );
+				usage( );
+				exit( EX_USAGE );
+			}
+			break;
+		case 'j':
+			jobs = (int)strtol( optarg, (char **)NULL, 0 );
+			if( jobs < 1 || jobs > JOBS_MAX ) {
+				printe( 1, "invalid number of workers (1-%d)\n", JOBS_MAX );
+				usage( );
+				exit( EX_USAGE );
+			}
+			break;
+		case 'B':
+			joblistfile = optarg;
+			break;
+		case 'J':
+			joblimits = optarg;
+			rc = sscanf( optarg, "%d:%d", &parallel, &per_device );
+			if( rc < 1 || parallel < 1 || parallel > JOBS_MAX || per_device < 1 ) {
+				printe( 1, "invalid number of jobs (1-%d[:per_device])\n", JOBS_MAX );
+				usage( );
+				exit( EX_USAGE );
+			}
+			break;
+		case 'S':
+			rc = (int)strtol( optarg, (char **)NULL, 0 );
+			if( rc < 0 || ! (stats = fdopen( rc, "w" )) ) {
+				printe( 1, "invalid file descriptor for the metrics (%s)\n", optarg );
+				usage( );
+				exit( EX_USAGE );
+			}
+			setvbuf( stats, NULL, _IOLBF, BUFSIZ );
+			break;
 		case 'V':
 			printf( "%s version %s (libdvdcss version %s)\n", progname, progversion, DVDCSS_VERSION_STRING);
 			exit( EX_SUCCESS );
@@ -171,17 +597,124 @@ int main( int argc, char *argv[] )
 	argv += optind;
 
 	/* Command line args */
-	if( argc < 1 || argc > 2 ) {
+	if( (joblistfile ? argc != 0 : argc < 1 || argc > 2)
+	    || (inplace && argc > 1) || (verifyfile && argc > 1)
+	    || (manifestfile && argc < 2 && ! inplace) ) {
 		printe( 1, "syntax error\n" );
 		usage( );
 		exit( EX_USAGE );
 	}
-	dvdfile = argv[0];
-	if( argc == 2 ) imgfile = argv[1];
-	if( !imgfile ) verbosity++;
+
+	/* Check an image against a manifest */
+	if( verifyfile )
+		exit( verifymanifest( verifyfile, argv[0] ) );
+
+	if( inplace && (dvdread_decrypt || sparse || ring_depth || direct || uring_depth) ) {
+		printe( 1, "-i cannot be used with -C, -s, -p, -d or -u\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( map_io && (inplace || sparse || direct || ring_depth || uring_depth) ) {
+		printe( 1, "-M cannot be used with -i, -s, -d, -p or -u\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( badmapfile && (inplace || map_io || ring_depth || uring_depth) ) {
+		printe( 1, "-e cannot be used with -i, -M, -p or -u\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( delta && (inplace || sparse || direct || map_io || uring_depth) ) {
+		printe( 1, "-D cannot be used with -i, -s, -d, -M or -u\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( uring_depth && (sparse || ring_depth) ) {
+		printe( 1, "-u cannot be used with -s or -p\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( sparse && direct ) {
+		printe( 1, "-s cannot be used with -d\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( argc == 2 && ! strcmp( argv[1], "-" ) && mapformat ) {
+		msg_stderr = 1;
+		printe( 1, "-m cannot be used with the image written to stdout\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( joblistfile && (inplace || journalfile || badmapfile || manifestfile
+	                    || verifyfile || mapformat) ) {
+		printe( 1, "-B cannot be used with -i, -r, -e, -H, -y or -m\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( joblimits && ! joblistfile ) {
+		printe( 1, "-J can only be used with -B\n" );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( joblistfile ) {
+		/* Each DVD is copied by a child process, this one waits for them */
+		status = runbatch( joblistfile, &dvdfile, &imgfile );
+		if( ! dvdfile )
+			exit( status );
+	}
+	else {
+		dvdfile = argv[0];
+		if( argc == 2 ) imgfile = argv[1];
+	}
+	if( inplace ) {
+		/* The DVD is its own image; the journal is not optional */
+		imgfile = dvdfile;
+		if( ! journalfile ) {
+			journalfile = malloc( strlen( dvdfile ) + sizeof( ".journal" ) );
+			if( ! journalfile ) {
+				printe( 1, "memory allocation failed\n" );
+				exit( EX_MEM );
+			}
+			sprintf( journalfile, "%s.journal", dvdfile );
+		}
+	}
+	/* The map is the only output on stdout by default */
+	if( !imgfile && !mapformat ) verbosity++;
+	/* The image is the only output on stdout */
+	if( imgfile && ! strcmp( imgfile, "-" ) ) msg_stderr = 1;
+	/* A pipe (or a socket...) is written in sector order */
+	if( imgfile && (msg_stderr ? fstat( STDOUT_FILENO, &imgstat )
+	                           : stat( imgfile, &imgstat )) == 0
+	    && ! S_ISREG( imgstat.st_mode ) && ! S_ISBLK( imgstat.st_mode ) )
+		streaming = 1;
+	if( streaming && (inplace || journalfile || sparse || direct || map_io || delta
+	                  || uring_depth || jobs > 1) ) {
+		printe( 1, "the image file (%s) is not seekable: -i, -r, -s, -d, -M, -D, -u"
+		  " and -j cannot be used\n", imgfile );
+		usage( );
+		exit( EX_USAGE );
+	}
+	if( streaming && badmapfile && access( badmapfile, F_OK ) == 0 ) {
+		printe( 1, "%s: the sectors of a bad sector map cannot be retried"
+		  " into a pipe\n", badmapfile );
+		usage( );
+		exit( EX_USAGE );
+	}
+
+	/* The image is mapped up to the end of the DVD */
+	if( map_io && imgfile && dvdsize( dvdfile ) <= 0 ) {
+		printe( 1, "-M cannot be used when the size of the DVD is unknown\n" );
+		exit( EX_USAGE );
+	}
 
 	/* Open the DVD */
 	printe( 2, "%s: version %s (libdvdcss version %s)\n", progname, progversion, DVDCSS_VERSION_STRING);
+	if( cachedir ) {
+		if( opencache( cachedir, dvdfile ) < 0 )
+			printe( 1, "WARNING no key cache (%s)\n", strerror( errno ) );
+		else
+			printe( 3, "%s: key cache %s\n", progname, keycache );
+	}
 	dvdcss = dvdcss_open( dvdfile );
 	if( dvdcss == NULL ) {
 		printe( 1, "opening of the DVD (%s) with libdvdcss failed\n", dvdfile );
@@ -192,53 +725,361 @@ int main( int argc, char *argv[] )
 		printe( 1, "opening of the  DVD (%s) failed\n", dvdfile );
 		exit( status | EX_OPEN );
 	}
+	statphase( PH_OPEN, statnow( ) );
 
 	/* Search the DVD for the positions of the title files */
-	blocks.tail = NULL;
-	blocks.block.start = 0;
-	blocks.block.size = dvdsize( dvdfile );
-	printe( 3, "%s: DVD end at 0x%08x\n", progname, blocks.block.size );
-	status |= savetitleblocks( dvd, &titles );
-	if( blocks.block.size < 0 ) {
-		printe( 1, "cannot determine the size of the DVD\n" );
-		blocks.block.size = 0;
+	size = dvdsize( dvdfile );
+	printe( 3, "%s: DVD end at 0x%08x\n", progname, size );
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	status |= savetitleblocks( dvd, dvdcss, &titles );
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printe( 2, "%s: title files located in %.3f s\n", progname, t );
+	statphase( PH_LOCATE, t );
+	if( ! titles ) {
+		DVDClose( dvd );
+		dvdcss_close( dvdcss );
+		exit( status | EX_MEM );
 	}
-	else
-		status |= removetitles( &blocks, titles );
+	if( size < 0 )
+		printe( 1, "cannot determine the size of the DVD\n" );
+	status |= mapextents( &map, titles, size );
+	if( mapformat )
+		printmap( &map, size, mapformat );
 
 	/* Make libdvdread try to get all the title keys now */
-	if( dvdread_check ) openfile( dvd, 0, DVD_READ_MENU_VOBS );
+	if( dvdread_check ) {
+		t = statnow( );
+		openfile( dvd, 0, DVD_READ_MENU_VOBS );
+		statphase( PH_KEYS, statnow( ) - t );
+		if( imgfile )
+			statfiles( dvd );
+	}
 
 	/* Check & Decrypt & Write */
 	if( imgfile ) {
-		img = open( imgfile, O_RDWR | O_CREAT,
+		img = msg_stderr ? STDOUT_FILENO : open( imgfile, inplace ? O_RDWR : O_RDWR | O_CREAT,
 		  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH );
+#ifdef O_DIRECT
+		if( img >= 0 && direct
+		    && fcntl( img, F_SETFL, fcntl( img, F_GETFL ) | O_DIRECT ) < 0 ) {
+			printe( 2, "%s: no direct I/O on the image file (%s)\n",
+			  progname, strerror( errno ) );
+			direct = 0;
+		}
+#else
+		direct = 0;
+#endif
 		if( img < 0 ) {
 			printe( 1, "opening of the image file (%s) failed (%s)\n",
 			  imgfile, strerror( errno ) );
 			status |= EX_OPEN;
 		}
+		else if( (journalfile && ((rc = openjournal( journalfile, size ))
+		                          || (inplace && (rc = journalrestore( img )))))
+		         || (badmapfile && (rc = openbadmap( badmapfile, size ))) ) {
+			status |= rc;
+			close( img );
+		}
 		else {
 			printe( 3, "\n" );
-			status |= decrypttitles( dvd, dvdcss, img, titles );
-			status |= copyblocks( dvdcss, img, &blocks );
+			/* Holes in a new image are already zeros */
+			if( sparse && fstat( img, &imgstat ) == 0 && imgstat.st_size > 0 )
+				sparse_punch = 1;
+			/* Allocate the whole image at once so that it is not fragmented */
+			if( direct )
+				status |= preallocate( img, size );
+			/* The unencrypted blocks of an image file are copied by the
+			 * kernel (the sparse mode needs to see the data) */
+			if( ! sparse && ! inplace && stat( dvdfile, &imgstat ) == 0
+			    && S_ISREG( imgstat.st_mode ) )
+				dvdfd = open( dvdfile, O_RDONLY );
+#if HAVE_COPY_FILE_RANGE
+			kernel_copy = dvdfd < 0 || map_io || manifestfile || delta ? 0 : 1;
+#elif HAVE_SENDFILE
+			kernel_copy = dvdfd < 0 || map_io || manifestfile || delta ? 0 : 2;
+#endif
+			/* The digests are computed as the sectors are written */
+			if( manifestfile )
+				status |= makeunits( &map );
+			/* The mappings of the image must be inside the file, on
+			 * allocated blocks (a full disk would be a SIGBUS) */
+			if( map_io
+			    && (rc = posix_fallocate( img, 0, (off_t)size * DVD_VIDEO_LB_LEN )) ) {
+				printe( 1, "extending the image file failed (%s)\n",
+				  strerror( rc ) );
+				status |= EX_IO;
+				map_io = 0;
+			}
+#if HAVE_POSIX_FADVISE
+			/* The DVD is read once */
+			if( direct && dvdfd >= 0 )
+				posix_fadvise( dvdfd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+			/* The workers have their own libdvdcss handle; libdvdread reads
+			 * (-C) remain sequential */
+			if( jobs > 1 && ! dvdread_decrypt ) {
+				memset( &pool, 0, sizeof( pool ) );
+				pool.dvdfile = dvdfile;
+				pool.img = img;
+				ppool = &pool;
+			}
+			t = statnow( );
+			status |= decrypttitles( dvd, dvdcss, img, titles, &map, ppool );
+			if( ppool )
+				status |= runworkers( ppool );
+			statphase( PH_COPY, statnow( ) - t );
+			t = statnow( );
+			if( undecrypted ) {
+				printe( 1, "%lld sectors still apparently scrambled after decryption\n",
+				  undecrypted );
+				status |= EX_MISMATCH;
+			}
+			if( badmapfile )
+				status |= writebadmap( badmapfile, size );
+			/* Zero sectors after the last mapped one */
+			if( streaming && size > 0
+			    && streamfill( img, (off_t)size * DVD_VIDEO_LB_LEN ) < 0 ) {
+				printe( 1, "writing the end of the image failed (%s)\n",
+				  strerror( errno ) );
+				status |= EX_IO;
+			}
+			if( sparse ) {
+				/* Trailing zero sectors were not written */
+				if( size > 0 && fstat( img, &imgstat ) == 0
+				    && imgstat.st_size < (off_t)size * DVD_VIDEO_LB_LEN
+				    && ftruncate( img, (off_t)size * DVD_VIDEO_LB_LEN ) < 0 ) {
+					printe( 1, "extending the image file failed (%s)\n",
+					  strerror( errno ) );
+					status |= EX_IO;
+				}
+				printe( 2, "%lld bytes of zero sectors not written\n", sparse_bytes );
+			}
+			if( delta )
+				printe( 2, "%lld bytes rewritten, %lld bytes unchanged\n",
+				  delta_bytes, delta_same );
+			if( manifestfile )
+				status |= writemanifest( manifestfile, imgfile, &map, size );
+			if( dvdfd >= 0 )
+				close( dvdfd );
+			if( journal_undo >= 0 )
+				close( journal_undo );
+			if( journal && fclose( journal ) == EOF ) {
+				printe( 1, "closing of the journal failed (%s)\n",
+				  strerror( errno ) );
+				status |= EX_IO;
+			}
+			if( inplace && status == EX_SUCCESS )
+				status |= removejournal( journalfile );
 			if( close( img ) < 0 ) {
 				printe( 1, "closing of the image file failed (%s)\n",
 				  strerror( errno ) );
 				status |= EX_IO;
 			}
+			statphase( PH_CLOSE, statnow( ) - t );
 		}
 	}
 
+	if( keycache )
+		printe( 2, "%s: title keys: %d found in the cache (%.1f s saved), %d searched (%.1f s)\n",
+		  progname, keys_cached, keys_saved, keys_searched, keys_time );
+
 	/* Close DVD */
+	free( copy_buffer );
+	free( copy_compare );
+	uringclose( &copy_uring );
+	free( hashes.units );
+	free( badsectors.bad );
+	free( badsectors.retry );
+	free( map.extents );
+	free( titles );
 	DVDClose( dvd );
 	if( dvdcss_close( dvdcss ) < 0 ) {
 		printe( 1, "closing of the DVD with libdvdcss failed\n" );
 		status |= EX_IO;
 	}
+	statsummary( size, status );
 	exit( status );
 }
 
+/* Copy the DVDs of a job list, a pair "dvd file" per line, by child
+ * processes, at most parallel at a time and per_device at a time reading from
+ * the same device; the jobs are started in the order of the list */
+/* In the parent the statuses of the jobs or-ed together are returned, with
+ * *dvdfile set to NULL; in a child *dvdfile and *imgfile are set to its job. */
+static int runbatch( const char *joblistfile, char **dvdfile, char **imgfile )
+{
+	FILE            *list;
+	job_t           *joblist = NULL, *job;
+	char            line[2*4096+16], dvd[4096], img[4096], *tab;
+	struct stat     buf;
+	struct timespec t0, now;
+	double          t, seconds;
+	long long       sectors = 0;
+	pid_t           pid;
+	int             count = 0, running = 0, done = 0, failed = 0;
+	int             i, j, busy, size, wstatus, status = EX_SUCCESS;
+
+	*dvdfile = NULL;
+	list = fopen( joblistfile, "r" );
+	if( list == NULL ) {
+		printe( 1, "opening of the job list (%s) failed (%s)\n",
+		  joblistfile, strerror( errno ) );
+		return EX_OPEN;
+	}
+	while( fgets( line, sizeof( line ), list ) ) {
+		/* "dvd<tab>file" (the names may then hold spaces), or two words */
+		line[strcspn( line, "\r\n" )] = '\0';
+		tab = strchr( line, '\t' );
+		if( tab && tab > line && tab[1] && ! strchr( tab+1, '\t' )
+		    && tab - line < (int)sizeof( dvd ) && strlen( tab+1 ) < sizeof( img ) ) {
+			sprintf( dvd, "%.*s", (int)(tab - line), line );
+			strcpy( img, tab+1 );
+		}
+		else if( sscanf( line, "%4095s %4095s", dvd, img ) != 2 )
+			continue;
+		if( dvd[0] == '#' )
+			continue;
+		if( count % 64 == 0 ) {
+			job = realloc( joblist, (count + 64) * sizeof( job_t ) );
+			if( ! job ) {
+				printe( 1, "memory allocation failed\n" );
+				fclose( list );
+				status = EX_MEM;
+				goto FREE;
+			}
+			joblist = job;
+		}
+		job = &joblist[count];
+		memset( job, 0, sizeof( *job ) );
+		job->dvdfile = strdup( dvd );
+		job->imgfile = strdup( img );
+		if( ! job->dvdfile || ! job->imgfile ) {
+			printe( 1, "memory allocation failed\n" );
+			fclose( list );
+			count++; /* so that its strings are freed */
+			status = EX_MEM;
+			goto FREE;
+		}
+		/* A drive, or the device of the file system holding an image */
+		if( stat( dvd, &buf ) == 0 )
+			job->device = S_ISBLK( buf.st_mode ) ? buf.st_rdev : buf.st_dev;
+		count++;
+	}
+	fclose( list );
+	if( count == 0 ) {
+		printe( 1, "%s: no jobs\n", joblistfile );
+		return EX_NOP;
+	}
+
+	fflush( stdout );
+	if( stats )
+		fflush( stats );
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	while( done < count ) {
+		/* Start the next jobs whose device is not busy */
+		for( i = 0; i < count && running < parallel; i++ ) {
+			job = &joblist[i];
+			if( job->pid )
+				continue;
+			for( j = 0, busy = 0; j < count; j++ )
+				if( joblist[j].pid > 0 && joblist[j].device == job->device )
+					busy++;
+			if( busy >= per_device )
+				continue;
+
+			clock_gettime( CLOCK_MONOTONIC, &job->start );
+			job->pid = fork( );
+			if( job->pid == 0 ) {
+				*dvdfile = job->dvdfile;
+				*imgfile = job->imgfile;
+				/* The metrics are those of the batch */
+				stats = NULL;
+				if( parallel > 1 )
+					progress_off = 1;
+				return EX_SUCCESS;
+			}
+			if( job->pid < 0 ) {
+				printe( 1, "job %d (%s): fork failed (%s)\n",
+				  i+1, job->dvdfile, strerror( errno ) );
+				job->pid = -1;
+				job->status = EX_MEM;
+				status |= job->status;
+				failed++;
+				done++;
+				continue;
+			}
+			printe( 2, "job %d: %s -> %s\n", i+1, job->dvdfile, job->imgfile );
+			running++;
+		}
+		if( running == 0 )
+			break;
+
+		/* Wait for one of them to exit */
+		pid = wait( &wstatus );
+		if( pid < 0 ) {
+			if( errno == EINTR )
+				continue;
+			printe( 1, "waiting for the jobs failed (%s)\n", strerror( errno ) );
+			status |= EX_IO;
+			break;
+		}
+		for( i = 0; i < count && joblist[i].pid != pid; i++ );
+		if( i == count )
+			continue;
+		job = &joblist[i];
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		seconds = (now.tv_sec - job->start.tv_sec)
+		          + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+		job->pid = -1;
+		running--;
+		done++;
+
+		if( WIFEXITED( wstatus ) )
+			job->status = WEXITSTATUS( wstatus );
+		else {
+			printe( 1, "job %d (%s): killed by signal %d\n",
+			  i+1, job->dvdfile, WTERMSIG( wstatus ) );
+			job->status = EX_IO;
+		}
+		status |= job->status;
+		/* A DVD that could not be opened was not copied */
+		size = (job->status & EX_OPEN) == EX_OPEN ? 0 : dvdsize( job->dvdfile );
+		if( size < 0 )
+			size = 0;
+		sectors += size;
+		if( job->status != EX_SUCCESS ) {
+			printe( 1, "job %d (%s): exit status %d\n", i+1, job->dvdfile, job->status );
+			failed++;
+		}
+		printe( 2, "job %d: %d sectors in %.3f s (%.1f MB/s)\n", i+1, size, seconds,
+		  seconds > 0 ? (double)size * DVD_VIDEO_LB_LEN / seconds / 1e6 : 0 );
+		statjob( i, job, size, seconds );
+	}
+
+	/* Summary */
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	t = (now.tv_sec - t0.tv_sec) + (now.tv_nsec - t0.tv_nsec) / 1e9;
+	printe( 1, "%d jobs (%d failed): %lld sectors in %.3f s (%.1f MB/s)\n",
+	  count, failed, sectors, t,
+	  t > 0 ? (double)sectors * DVD_VIDEO_LB_LEN / t / 1e6 : 0 );
+	if( stats ) {
+		fprintf( stats, "{\"event\": \"batch\", \"jobs\": %d, \"failed\": %d, "
+		  "\"seconds\": %.3f, \"sectors\": %lld, \"status\": %d, \"avg_mb_per_s\": %.1f}\n",
+		  count, failed, t, sectors, status,
+		  t > 0 ? (double)sectors * DVD_VIDEO_LB_LEN / t / 1e6 : 0 );
+		fclose( stats );
+	}
+
+FREE:
+	for( i = 0; i < count; i++ ) {
+		free( joblist[i].dvdfile );
+		free( joblist[i].imgfile );
+	}
+	free( joblist );
+	return status;
+}
+
 /* Return the size in sectors (whether it is a file or a special device) */
 static int dvdsize( const char *dvdfile )
 {
@@ -276,8 +1117,10 @@ static int dvdsize( const char *dvdfile )
 	return size / DVD_VIDEO_LB_LEN;
 }
 
-/* Save the sector positions of the title/domain files */
-static int savetitleblocks( dvd_reader_t *dvd, titleblocks_t (*titles)[TITLE_MAX] )
+/* Save the sector positions of the title/domain files in a new title table */
+/* The directory VIDEO_TS is scanned once; if it cannot be, the file names
+ * are searched one by one for TITLE_MAX titles. */
+static int savetitleblocks( dvd_reader_t *dvd, dvdcss_t dvdcss, titleblocks_t **titles )
 {
 	int           status = EX_SUCCESS;
 	char          filename[32]; /* MAX_UDF_FILE_NAME_LEN too much */
@@ -285,12 +1128,24 @@ static int savetitleblocks( dvd_reader_t *dvd, titleblocks_t (*titles)[TITLE_MAX
 	block_t       block;
 	int           count = 0, title, i, start;
 
+	status = scantitleblocks( dvd, dvdcss, titles );
+	if( status >= 0 )
+		return status;
+	status = EX_SUCCESS;
+	printe( 3, "%s: searching the title files by name\n", progname );
+	*titles = malloc( TITLE_MAX * sizeof( titleblocks_t ) );
+	if( ! *titles ) {
+		printe( 1, "memory allocation failed\n" );
+		return EX_MEM;
+	}
+	title_count = TITLE_MAX;
+
 	/* Video Manager */
 	title = 0;
 	tblocks = &(*titles)[title];
 	sprintf( filename, "/VIDEO_TS/VIDEO_TS.%s", "IFO" );
-	fileblock( dvd, filename, &tblocks->ifo )
-	|| printf( "%s: WARNING %s not found\n", progname, filename );
+	if( ! fileblock( dvd, filename, &tblocks->ifo ) )
+		printe( 1, "WARNING %s not found\n", filename );
 	sprintf( filename, "/VIDEO_TS/VIDEO_TS.%s", "VOB" );
 	fileblock( dvd, filename, &tblocks->menu );
 	fileblock( dvd, "/VIDEO_TS/invalid_name/", &tblocks->vob );
@@ -298,7 +1153,7 @@ static int savetitleblocks( dvd_reader_t *dvd, titleblocks_t (*titles)[TITLE_MAX
 	fileblock( dvd, filename, &tblocks->bup );
 
 	/* Titles */
-	for( title = 1; title < TITLE_MAX; title++ ) {
+	for( title = 1; title < title_count; title++ ) {
 		tblocks = &(*titles)[title];
 		sprintf( filename, "/VIDEO_TS/VTS_%02d_%d.%s", title, 0, "IFO" );
 		fileblock( dvd, filename, &tblocks->ifo )
@@ -328,6 +1183,218 @@ static int savetitleblocks( dvd_reader_t *dvd, titleblocks_t (*titles)[TITLE_MAX
 	return status;
 }
 
+/* Fill a new title table from a single scan of the directory VIDEO_TS (read
+ * with dvdcss); return -1 if the directory could not be scanned */
+static int scantitleblocks( dvd_reader_t *dvd, dvdcss_t dvdcss, titleblocks_t **titles )
+{
+	int           status = EX_SUCCESS;
+	unsigned char *dir = NULL, sector[DVD_VIDEO_LB_LEN];
+	int           *vobend = NULL; /* end of the last sector of the title VOBs */
+	uint32_t      dirsector, dirsize;
+	block_t       file, block, *part;
+	titleblocks_t *tblocks;
+	char          name[32], ext[4];
+	int           partstart = -1, files = 0, count = 0, title, p, off, len, i;
+
+	*titles = NULL;
+
+	/* Anchor volume descriptor, then partition descriptor of the main
+	 * volume descriptor sequence */
+	if( readsectors( dvdcss, 256, 1, sector ) < 0 || le16( sector ) != 2 )
+		return -1;
+	off = le32( sector + 20 );
+	len = le32( sector + 16 ) / DVD_VIDEO_LB_LEN;
+	for( i = 0; i < len && i < 16 && partstart < 0; i++ ) {
+		if( readsectors( dvdcss, off + i, 1, sector ) < 0 )
+			return -1;
+		if( le16( sector ) == 5 )
+			partstart = le32( sector + 188 );
+		if( le16( sector ) == 8 ) /* terminator */
+			break;
+	}
+	if( partstart < 0 )
+		return -1;
+
+	/* File identifier descriptors of VIDEO_TS */
+	dirsector = UDFFindFile( dvd, "/VIDEO_TS", &dirsize );
+	if( ! dirsector || dirsize == 0 || dirsize > 64 * DVD_VIDEO_LB_LEN )
+		return -1;
+	dir = malloc( (dirsize + DVD_VIDEO_LB_LEN-1) / DVD_VIDEO_LB_LEN * DVD_VIDEO_LB_LEN );
+	if( ! dir ) {
+		printe( 1, "memory allocation failed\n" );
+		return -1;
+	}
+	if( readsectors( dvdcss, dirsector, (dirsize + DVD_VIDEO_LB_LEN-1) / DVD_VIDEO_LB_LEN,
+	                 dir ) < 0 )
+		goto FAIL;
+
+	/* Size the table after the highest title */
+	title_count = 1;
+	for( p = 0; p < 2; p++ ) {
+		if( p == 1 ) {
+			*titles = malloc( title_count * sizeof( titleblocks_t ) );
+			vobend = calloc( title_count, sizeof( int ) );
+			if( ! *titles || ! vobend ) {
+				printe( 1, "memory allocation failed\n" );
+				goto FAIL;
+			}
+			for( title = 0; title < title_count; title++ ) {
+				tblocks = &(*titles)[title];
+				tblocks->ifo.start = tblocks->menu.start = 0;
+				tblocks->vob.start = tblocks->bup.start = 0;
+				tblocks->ifo.size = tblocks->menu.size = -1;
+				tblocks->vob.size = tblocks->bup.size = -1;
+			}
+		}
+
+		for( off = 0; off + 38 <= (int)dirsize; off += len ) {
+			unsigned char *fid = dir + off;
+			int           lfi = fid[19], liu = le16( fid + 36 );
+
+			if( le16( fid ) != 257 )
+				goto FAIL;
+			len = (38 + liu + lfi + 3) & ~3;
+			if( off + 38 + liu + lfi > (int)dirsize )
+				goto FAIL;
+			/* Skip the parent, directories and deleted files */
+			if( fid[18] & 0x0e || lfi < 2 || lfi > 32 || fid[38+liu] != 8 )
+				continue;
+			memcpy( name, fid + 38 + liu + 1, lfi - 1 );
+			name[lfi-1] = '\0';
+
+			/* VIDEO_TS.xxx or VTS_tt_p.xxx */
+			if( sscanf( name, "VIDEO_TS.%3s", ext ) == 1 )
+				title = i = 0;
+			else if( sscanf( name, "VTS_%2d_%d.%3s", &title, &i, ext ) != 3
+			         || title < 1 )
+				continue;
+			if( p == 0 ) {
+				if( title >= title_count ) title_count = title + 1;
+				continue;
+			}
+
+			if( ! udffileblock( dvdcss, partstart, le32( fid + 24 ), &file ) ) {
+				printe( 1, "WARNING /VIDEO_TS/%s not readable\n", name );
+				continue;
+			}
+			block = file;
+			tblocks = &(*titles)[title];
+			if( ! strcmp( ext, "IFO" ) && i == 0 )
+				part = &tblocks->ifo;
+			else if( ! strcmp( ext, "BUP" ) && i == 0 )
+				part = &tblocks->bup;
+			else if( ! strcmp( ext, "VOB" ) && i == 0 )
+				part = &tblocks->menu;
+			else if( ! strcmp( ext, "VOB" ) && title > 0 ) {
+				/* Title VOBs may be split into several files (in any
+				 * order in the directory) */
+				part = &tblocks->vob;
+				if( block.start + block.size > vobend[title] )
+					vobend[title] = block.start + block.size;
+				if( part->size >= 0 ) {
+					if( block.start < part->start )
+						part->start = block.start;
+					block.start = part->start;
+					block.size += part->size;
+				}
+			}
+			else
+				continue;
+			*part = block;
+			files++;
+			printe( 3, "%s: /VIDEO_TS/%s at 0x%08x-0x%08x\n",
+			  progname, name, file.start, file.start+file.size );
+		}
+	}
+	free( dir );
+
+	for( title = 1; title < title_count; title++ ) {
+		part = &(*titles)[title].vob;
+		if( part->size >= 0 && part->start + part->size != vobend[title] ) {
+			printe( 1, "WARNING whole in the VOBs of title %d\n", title );
+			status |= EX_MISMATCH;
+		}
+	}
+	free( vobend );
+
+	if( (*titles)[0].ifo.size < 0 )
+		printe( 1, "WARNING %s not found\n", "/VIDEO_TS/VIDEO_TS.IFO" );
+	for( title = 1; title < title_count; title++ )
+		if( (*titles)[title].ifo.size >= 0 ) count++;
+	printe( 3, "%s: %d titles found (%d files in a directory scan)\n",
+	  progname, count, files );
+	return status;
+
+FAIL:
+	free( dir );
+	free( vobend );
+	free( *titles );
+	*titles = NULL;
+	return -1;
+}
+
+/* Find the extent of the file whose file entry is at the logical block lb of
+ * the partition starting at partstart */
+static int udffileblock( dvdcss_t dvdcss, int partstart, int lb, block_t *block )
+{
+	unsigned char entry[DVD_VIDEO_LB_LEN];
+	int           ea, ad;
+	uint64_t      size;
+
+	if( readsectors( dvdcss, partstart + lb, 1, entry ) < 0 )
+		return 0;
+	if( le16( entry ) == 261 ) { /* file entry */
+		ea = le32( entry + 168 );
+		ad = 176 + ea;
+	}
+	else if( le16( entry ) == 266 ) { /* extended file entry */
+		ea = le32( entry + 208 );
+		ad = 216 + ea;
+	}
+	else
+		return 0;
+	/* The first allocation descriptor (short or long) gives the start */
+	if( (le16( entry + 34 ) & 7) > 1 || ad + 8 > DVD_VIDEO_LB_LEN )
+		return 0;
+	size = le32( entry + 56 ) | (uint64_t)le32( entry + 60 ) << 32;
+	if( size % DVD_VIDEO_LB_LEN )
+		printe( 1, "WARNING size of a file is not a block multiple\n" );
+	block->start = partstart + le32( entry + ad + 4 );
+	block->size = size / DVD_VIDEO_LB_LEN;
+	return 1;
+}
+
+/* Read n sectors at lb with dvdcss, without decryption */
+static int readsectors( dvdcss_t dvdcss, int lb, int n, unsigned char *buffer )
+{
+	statcount( OP_READ, 1, (long long)n * DVD_VIDEO_LB_LEN );
+	if( seekdvd( dvdcss, lb, DVDCSS_NOFLAGS ) < 0
+	    || dvdcss_read( dvdcss, buffer, n, DVDCSS_NOFLAGS ) != n )
+		return -1;
+	return n;
+}
+
+/* Seek with dvdcss, counting the seeks */
+static int seekdvd( dvdcss_t dvdcss, int lb, int flags )
+{
+	statcount( OP_SEEK, 1, 0 );
+	return dvdcss_seek( dvdcss, lb, flags );
+}
+
+/* Get the title key at lb through the key cache, counting the seek and the
+ * time taken */
+static int seekdvdkey( dvdcss_t dvdcss, int lb )
+{
+	double t;
+	int    rc;
+
+	statcount( OP_SEEK, 1, 0 );
+	rc = seekkey( dvdcss, lb, &t );
+	if( rc >= 0 )
+		statphase( PH_KEYS, t );
+	return rc;
+}
+
 /* Record the sector range over which a file spans */
 static int fileblock( dvd_reader_t *dvd, char *filename, block_t *block )
 {
@@ -351,157 +1418,424 @@ static int fileblock( dvd_reader_t *dvd, char *filename, block_t *block )
 	return 0;
 }
 
-/* Remove from blocks the block sectors of all title/domains */
-static int removetitles( blockl_t blocks, titleblocks_t titles[] )
+/* Map the title/domains and the ordinary blocks between them, in a single
+ * allocation */
+/* Overlapping title/domains are reported as mismatches; if size is negative
+ * (unknown) there are no ordinary blocks. */
+static int mapextents( extmap_t *map, titleblocks_t titles[], int size )
 {
+	extent_t          *extents, *title;
 	block_t           *block;
 	dvd_read_domain_t domain;
-	int               title, i, rc, status = EX_SUCCESS;
+	int               n = 0, end = 0, t, i, status = EX_SUCCESS;
+
+	/* A gap before each title/domain and one at the end at most */
+	map->count = 0;
+	map->extents = extents = malloc( (2*title_count*DOMAIN_MAX+1) * sizeof( extent_t ) );
+	if( ! extents ) {
+		printe( 1, "memory allocation failed\n" );
+		return EX_MEM;
+	}
 
-	for( title = 0; title < TITLE_MAX; title++ )
+	/* Title/domains, sorted at the end of the array */
+	title = extents + title_count*DOMAIN_MAX+1;
+	for( t = 0; t < title_count; t++ )
 		for( i = 0; i < DOMAIN_MAX; i++ ) {
 			domain = dvd_read_domains[i];
-			block = domainblock( &titles[title], domain );
-			rc = removeblock( blocks, *block );
-			if( rc == 0 ) {
-				printe( 1, "Title %02d %s: block mismatch\n",
-				  title, domainname( domain ) );
-				status |= EX_MISMATCH;
-			}
-			if( rc == -1 ) {
-				status |= EX_MEM;
-				break;
-			}
+			block = domainblock( &titles[t], domain );
+			if( block->size <= 0 ) /* inexistent or empty */
+				continue;
+			title[n].block = *block;
+			title[n].title = t;
+			title[n++].domain = domain;
+		}
+	qsort( title, n, sizeof( extent_t ), cmpextents );
+
+	/* Interleave the gaps */
+	for( i = 0; i < n; i++ ) {
+		if( size >= 0 && title[i].block.start > end ) {
+			extents[map->count].block.start = end;
+			extents[map->count].block.size = title[i].block.start - end;
+			extents[map->count++].title = GAP;
+		}
+		if( title[i].block.start < end
+		    || (size >= 0 && title[i].block.start+title[i].block.size > size) ) {
+			printe( 1, "Title %02d %s: block mismatch\n",
+			  title[i].title, domainname( title[i].domain ) );
+			status |= EX_MISMATCH;
 		}
+		extents[map->count++] = title[i];
+		if( title[i].block.start+title[i].block.size > end )
+			end = title[i].block.start+title[i].block.size;
+	}
+	if( size > end ) {
+		extents[map->count].block.start = end;
+		extents[map->count].block.size = size - end;
+		extents[map->count++].title = GAP;
+	}
 
 	return status;
 }
 
-/* Remove a block from a block list (if it is contained in a block of the list) */
-/* Inexistent/invalid blocks are ignored. */
-/* If the list is increasing the result is also increasing. */
-/* blocks must contain freeable memory (except for the first one). */
-static int removeblock( blockl_t blocks, const block_t block )
+static int cmpextents( const void *a, const void *b )
 {
-	blockl_t cur, new;
-
-	if( block.size < 0)
-		return 1;
+	return ((const extent_t *)a)->block.start - ((const extent_t *)b)->block.start;
+}
 
-	for( cur = blocks; cur != NULL; cur = cur->tail )
-		if
-			( cur->block.start <= block.start
-			  && cur->block.start+cur->block.size >= block.start+block.size )
-		{
-			/* Allocate a new node */
-			new = malloc( sizeof( struct blockl ) );
-			if( ! new ) {
-				printe( 1, "memory allocation failed\n" );
-				return -1;
-			}
-			/* Make a hole */
-			new->block.start = block.start + block.size;
-			new->block.size = cur->block.start + cur->block.size - new->block.start;
-			cur->block.size = block.start - cur->block.start;
-			/* Insert the new block */
-			new->tail = cur->tail;
-			cur->tail = new;
-			/* Remove empty blocks */
-			if( new->block.size == 0 ) {
-				cur->tail = new->tail;
-				free( new );
-			}
-			if( cur->block.size == 0 ) {
-				new = cur->tail;
-				*cur = *cur->tail;
-				free( new );
-			}
-			return 1;
-		}
+/* Print the map of the DVD on stdout, as text or as JSON */
+static void printmap( const extmap_t *map, int size, int format )
+{
+	const extent_t *extent;
+	const char     *kind;
+	int            i;
 
-	return 0;
+	if( format == 'j' )
+		printf( "{\"size\": %d, \"extents\": [", size );
+	for( i = 0; i < map->count; i++ ) {
+		extent = &map->extents[i];
+		kind = extent->title == GAP ? "GAP" : domainname( extent->domain );
+		if( format == 'j' )
+			printf( "%s\n  {\"start\": %d, \"size\": %d, \"kind\": \"%s\", \"title\": %d}",
+			  i ? "," : "", extent->block.start, extent->block.size, kind,
+			  extent->title );
+		else
+			printf( "%d %d %s %d\n", extent->block.start, extent->block.size, kind,
+			  extent->title );
+	}
+	if( format == 'j' )
+		printf( "\n]}\n" );
 }
 
-/* Iterate over titles and domains and check consistency and copy blocks
- * corresponding to a VOB domain at the right position */
-static int decrypttitles( dvd_reader_t *dvd, dvdcss_t dvdcss, int img, titleblocks_t titles[] )
+/* Copy the DVD in a single sweep in increasing sector order: decrypt the
+ * title/domains corresponding to a VOB domain and copy the others as well as
+ * the ordinary blocks */
+/* If pool is not NULL, the blocks are queued for the workers instead. */
+/* In place, only the VOB domains are processed. */
+static int decrypttitles( dvd_reader_t *dvd, dvdcss_t dvdcss, int img,
+                          titleblocks_t titles[], const extmap_t *map, pool_t *pool )
 {
-	dvd_file_t        *file;
+	const extent_t    *extent;
 	block_t           *block;
 	char              blockname[24];
 	dvd_read_domain_t domain;
-	int               title, i, rc, status = EX_NOP;
+	double            t;
+	int               title, i, rc, found = 0, status = EX_SUCCESS, gaps = EX_SUCCESS;
+
+	rc = countseeks( titles, map );
+	if( rc > 0 )
+		printe( 2, "%d seeks avoided by the copy in sector order\n", rc );
 
-	for( title = 0; title < TITLE_MAX; title++ )
+	/* Title/domains that are not mapped (inexistent or empty) */
+	for( title = 0; title < title_count; title++ )
 		for( i = 0; i < DOMAIN_MAX; i++ ) {
 			domain = dvd_read_domains[i];
 			block = domainblock( &titles[title], domain );
-			if( dvdread_check )
-				file = openfile( dvd, title, domain );
-			snprintf( blockname, 24, "Title %02d %s", title, domainname( domain ) );
+			if( block->size > 0 ) continue;
+			rc = copydomain( dvd, dvdcss, img, title, domain, block, pool );
+			if( ! (rc & EX_NOP) ) found = 1;
+			status |= rc & ~EX_NOP;
+		}
 
-			/* Checks */
-			if( dvdread_check && (!!file != !!(block->size >= 0)) ) {
-				printe( 1, "ERROR %s: domain mismatch\n", blockname );
-				status |= EX_MISMATCH;
-			}
-			if( dvdread_check && ! file ) continue;
-			if( domain == DVD_READ_INFO_FILE )
-				printe( 2, "TITLE %02d\n", title );
-			if( dvdread_check && (DVDFileSize( file ) != (ssize_t)(block->size)) ) {
-				printe( 1, "ERROR %s: size mismatch %zd != %d\n",
-				  blockname, DVDFileSize( file ), block->size );
-				status |= EX_MISMATCH;
+	/* Mapped title/domains and ordinary blocks */
+	for( i = 0; i < map->count; i++ ) {
+		extent = &map->extents[i];
+		t = statnow( );
+		if( extent->title != GAP ) {
+			block = domainblock( &titles[extent->title], extent->domain );
+			rc = copydomain( dvd, dvdcss, img, extent->title, extent->domain,
+			                 block, pool );
+			if( ! (rc & EX_NOP) ) found = 1;
+			status |= rc & ~EX_NOP;
+			if( ! pool ) {
+				snprintf( blockname, 24, "Title %02d %s",
+				  extent->title, domainname( extent->domain ) );
+				statextent( blockname, extent->block.start, extent->block.size, 0, t );
 			}
+			continue;
+		}
 
-			/* Decrypt VOBs only */
-			if( domain != DVD_READ_MENU_VOBS && domain != DVD_READ_TITLE_VOBS )
-				rc = copyblock( NULL, dvdcss, img, *block, blockname );
-			else
-				rc = copyblock( dvdread_check ? file : (void *)1,
-				                dvdread_decrypt ? NULL : dvdcss, img, *block, blockname );
-			status |= rc;
-			status &= ~EX_NOP;
-			if( rc != EX_SUCCESS )
-				printe( 1, "%s: partial decryption\n", blockname );
+		/* In place, the ordinary blocks are already there */
+		if( inplace ) continue;
+		snprintf( blockname, 24, "Block %08x-%08x",
+		  extent->block.start, extent->block.start+extent->block.size );
+		if( pool )
+			gaps |= queueblock( pool, extent->block, 0, 1, blockname );
+		else {
+			gaps |= copyblock( NULL, dvdcss, img, extent->block, blockname );
+			statextent( blockname, extent->block.start, extent->block.size, 1, t );
+		}
+	}
+
+	if( gaps )
+		printe( 1, "error while copying ordinary blocks\n" );
+	return status | gaps | (found ? EX_SUCCESS : EX_NOP);
+}
+
+/* Check consistency and copy a title/domain; return EX_NOP if it does not
+ * exist according to libdvdread */
+static int copydomain( dvd_reader_t *dvd, dvdcss_t dvdcss, int img, int title,
+                       dvd_read_domain_t domain, block_t *block, pool_t *pool )
+{
+	dvd_file_t *file = NULL;
+	char       blockname[24];
+	int        size, rc, status = EX_SUCCESS;
 
-			DVDCloseFile( file );
+	size = dvdread_check ? domainblock( &dvdread_blocks[title], domain )->size : -1;
+	snprintf( blockname, 24, "Title %02d %s", title, domainname( domain ) );
+
+	/* Checks */
+	if( dvdread_check && ((size >= 0) != (block->size >= 0)) ) {
+		printe( 1, "ERROR %s: domain mismatch\n", blockname );
+		status |= EX_MISMATCH;
+	}
+	if( dvdread_check && size < 0 ) return status | EX_NOP;
+	if( domain == DVD_READ_INFO_FILE )
+		printe( 2, "TITLE %02d\n", title );
+	if( dvdread_check && size != block->size ) {
+		printe( 1, "ERROR %s: size mismatch %d != %d\n",
+		  blockname, size, block->size );
+		status |= EX_MISMATCH;
+	}
+
+	/* Only the VOBs decrypted by libdvdread are opened with it */
+	if( dvdread_decrypt && (domain == DVD_READ_MENU_VOBS
+	                        || domain == DVD_READ_TITLE_VOBS) ) {
+		file = DVDOpenFile( dvd, title, domain );
+		if( ! file ) {
+			printe( 1, "ERROR %s: opening with libdvdread failed\n", blockname );
+			return status | EX_IO;
 		}
+	}
+
+	/* Get the title keys once for all the workers (they get them
+	 * from the cache of libdvdcss); they report the errors */
+	if( pool && block->size > 0 && (domain == DVD_READ_MENU_VOBS
+	                                || domain == DVD_READ_TITLE_VOBS) )
+		seekdvdkey( dvdcss, block->start );
+
+	/* Decrypt VOBs only */
+	if( inplace && domain != DVD_READ_MENU_VOBS && domain != DVD_READ_TITLE_VOBS )
+		rc = EX_SUCCESS;
+	else if( pool )
+		rc = queueblock( pool, *block, domain == DVD_READ_MENU_VOBS
+		                 || domain == DVD_READ_TITLE_VOBS, 0, blockname );
+	else if( domain != DVD_READ_MENU_VOBS && domain != DVD_READ_TITLE_VOBS )
+		rc = copyblock( NULL, dvdcss, img, *block, blockname );
+	else
+		rc = copyblock( file ? file : (void *)1, file ? NULL : dvdcss,
+		                img, *block, blockname );
+	status |= rc;
+	if( rc != EX_SUCCESS )
+		printe( 1, "%s: partial decryption\n", blockname );
 
+	if( file )
+		DVDCloseFile( file );
 	return status;
 }
 
-static int copyblocks( dvdcss_t dvdcss, int img, blockl_t blocks )
+/* Count the seeks avoided by copying the map in order instead of copying the
+ * title/domains then the ordinary blocks */
+static int countseeks( titleblocks_t titles[], const extmap_t *map )
 {
-	char blockname[24];
-	int  status = EX_SUCCESS;
+	block_t *block;
+	int     title, i, pos = 0, before = 0, after = 0;
 
-	printe( 2, "BLOCKS\n" );
-	for( ; blocks != NULL; blocks = blocks->tail ) {
-		snprintf( blockname, 24, "Block %08x-%08x",
-		  blocks->block.start, blocks->block.start+blocks->block.size );
-		status |= copyblock( NULL, dvdcss, img, blocks->block, blockname );
+	for( title = 0; title < title_count; title++ )
+		for( i = 0; i < DOMAIN_MAX; i++ ) {
+			block = domainblock( &titles[title], dvd_read_domains[i] );
+			if( block->size <= 0 ) continue;
+			if( block->start != pos ) before++;
+			pos = block->start + block->size;
+		}
+	for( i = 0; i < map->count; i++ )
+		if( map->extents[i].title == GAP ) {
+			if( map->extents[i].block.start != pos ) before++;
+			pos = map->extents[i].block.start + map->extents[i].block.size;
+		}
+
+	for( i = 0, pos = 0; i < map->count; i++ ) {
+		if( map->extents[i].block.start != pos ) after++;
+		pos = map->extents[i].block.start + map->extents[i].block.size;
 	}
 
-	if( status )
-		printe( 1, "error while copying ordinary blocks\n" );
-	return status;
+	return before - after;
+}
+
+/* Queue a title/domain for the workers, cut into chunks of CHUNK_SECTORS */
+static int queueblock( pool_t *pool, block_t block, int decrypt, int gap,
+                       const char *blockname )
+{
+	work_t *items;
+	int    lb;
+
+	if( block.size <= 0 ) {
+		printe( 2, "%s: %s\n", blockname, block.size < 0 ? "inva" : "null" );
+		return EX_SUCCESS;
+	}
+
+	for( lb = 0; lb < block.size; lb += CHUNK_SECTORS ) {
+		if( pool->count == pool->alloc ) {
+			pool->alloc = pool->alloc ? pool->alloc * 2 : 64;
+			items = realloc( pool->items, pool->alloc * sizeof( work_t ) );
+			if( ! items ) {
+				printe( 1, "memory allocation failed\n" );
+				return EX_MEM;
+			}
+			pool->items = items;
+		}
+		items = &pool->items[pool->count++];
+		items->extent = block;
+		items->lb = lb;
+		items->end = block.size - lb < CHUNK_SECTORS ? block.size : lb + CHUNK_SECTORS;
+		items->decrypt = decrypt;
+		items->gap = gap;
+		snprintf( items->name, 24, "%s", blockname );
+	}
+
+	return EX_SUCCESS;
+}
+
+/* Run jobs workers over the queued chunks and wait for them */
+static int runworkers( pool_t *pool )
+{
+	pthread_t workers[JOBS_MAX];
+	int       i, n, rc;
+
+	printe( 2, "WORKERS %d (%d chunks)\n", jobs, pool->count );
+	pthread_mutex_init( &pool->lock, NULL );
+	progress_off = 1;
+	for( n = 0; n < jobs && n < pool->count; n++ ) {
+		rc = pthread_create( &workers[n], NULL, workerthread, pool );
+		if( rc ) {
+			printe( 1, "creation of a worker thread failed (%s)\n", strerror( rc ) );
+			if( n == 0 ) pool->status |= EX_MEM;
+			break;
+		}
+	}
+	for( i = 0; i < n; i++ )
+		pthread_join( workers[i], NULL );
+	progress_off = 0;
+	pthread_mutex_destroy( &pool->lock );
+
+	free( pool->items );
+	pool->items = NULL;
+	return pool->status;
+}
+
+/* Take chunks from the pool and copy them, with a libdvdcss handle of its own */
+static void *workerthread( void *arg )
+{
+	pool_t        *pool = arg;
+	work_t        *item;
+	dvdcss_t      dvdcss;
+	unsigned char *buffer, *compare = NULL;
+	uring_t       uring;
+	double        t;
+	int           slot, rc, status = EX_SUCCESS;
+
+	pthread_mutex_lock( &pool->lock );
+	slot = pool->workers++;
+	pthread_mutex_unlock( &pool->lock );
+	dvdcss = dvdcss_open( pool->dvdfile );
+	if( dvdcss == NULL ) {
+		printe( 1, "opening of the DVD (%s) with libdvdcss failed\n", pool->dvdfile );
+		status |= EX_OPEN;
+		goto EXIT;
+	}
+	errno = posix_memalign( (void **)&buffer, BUFFER_ALIGN, inplace ?
+	  (size_t)CHUNK_SECTORS * DVD_VIDEO_LB_LEN : slotsize( ) * (uring_depth ? uring_depth : 1) );
+	if( ! errno && delta && (errno = posix_memalign( (void **)&compare, BUFFER_ALIGN,
+	                                                 (size_t)batch * DVD_VIDEO_LB_LEN )) )
+		free( buffer );
+	if( errno ) {
+		printe( 1, "memory allocation failed (%s)\n", strerror( errno ) );
+		status |= EX_MEM;
+		goto CLOSE;
+	}
+	uring.fd = -1;
+	if( uring_depth )
+		uringopen( &uring );
+
+	for( ; ; ) {
+		pthread_mutex_lock( &pool->lock );
+		item = pool->next < pool->count ? &pool->items[pool->next++] : NULL;
+		pthread_mutex_unlock( &pool->lock );
+		if( ! item ) break;
+		if( journal && journaldone( item->extent.start+item->lb, item->end-item->lb ) ) {
+			printe( 2, "%s: sectors %d-%d already done\n", item->name, item->lb, item->end );
+			continue;
+		}
+
+		/* The title key is that of the start of the title/domain */
+		t = statnow( );
+		rc = seekdvd( dvdcss, item->extent.start,
+		              item->decrypt ? DVDCSS_SEEK_KEY : DVDCSS_NOFLAGS );
+		if( item->decrypt )
+			statphase( PH_KEYS, statnow( ) - t );
+		if( rc >= 0 && item->lb > 0 )
+			rc = seekdvd( dvdcss, item->extent.start + item->lb, DVDCSS_NOFLAGS );
+		if( rc < 0 ) {
+			printe( 1, "%s: seeking in the input (dvdcss%s) failed (%s)\n",
+			  item->name, item->decrypt ? " key" : "", dvdcss_error( dvdcss ) );
+			rc = EX_IO;
+		}
+		else if( inplace )
+			rc = inplaceblock( dvdcss, pool->img, item->extent, item->lb, item->end,
+			                   slot, buffer, item->name );
+		else if( map_io )
+			rc = mapblock( item->decrypt ? (void *)1 : NULL, dvdcss, pool->img,
+			               item->extent, item->lb, item->end,
+			               item->decrypt ? DVDCSS_READ_DECRYPT : DVDCSS_NOFLAGS,
+			               item->name );
+		else if( uring.fd >= 0 && (item->decrypt || ! copymode( )) )
+			rc = uringblock( item->decrypt ? (void *)1 : NULL, dvdcss, pool->img,
+			                 item->extent, item->lb, item->end,
+			                 item->decrypt ? DVDCSS_READ_DECRYPT : DVDCSS_NOFLAGS,
+			                 buffer, item->name, &uring );
+		else
+			rc = syncblock( item->decrypt ? (void *)1 : NULL, dvdcss, pool->img,
+			                item->extent, item->lb, item->end,
+			                item->decrypt ? DVDCSS_READ_DECRYPT : DVDCSS_NOFLAGS,
+			                buffer, compare, item->name );
+		if( rc == EX_SUCCESS && journal )
+			rc = journalmark( pool->img, item->extent.start+item->lb, item->end-item->lb );
+		if( direct )
+			dropcache( item->extent.start+item->lb, item->end-item->lb );
+		statextent( item->name, item->extent.start+item->lb, item->end-item->lb,
+		            item->gap, t );
+		status |= rc;
+		if( rc != EX_SUCCESS )
+			printe( 1, "%s: partial decryption\n", item->name );
+		else
+			printe( 2, "%s: sectors %d-%d done\n", item->name, item->lb, item->end );
+	}
+
+	uringclose( &uring );
+	free( compare );
+	free( buffer );
+CLOSE:
+	if( dvdcss_close( dvdcss ) < 0 ) {
+		printe( 1, "closing of the DVD with libdvdcss failed\n" );
+		status |= EX_IO;
+	}
+EXIT:
+	pthread_mutex_lock( &pool->lock );
+	pool->status |= status;
+	pthread_mutex_unlock( &pool->lock );
+	return NULL;
 }
 
 /* If file is not NULL, copy/decrypt a title/domain, using libdvdcss for
  * reading if dvdcss is not NULL, using libdvdread otherwise. */
 /* If file is NULL, copy an ordinary block (ignoring title and domain). */
+/* The sectors are transferred batch sectors at a time; with a ring of buffers
+ * the reading is done by a separate thread so as to overlap with the writing. */
 static int copyblock( dvd_file_t *file, dvdcss_t dvdcss, int img,
                       block_t block, const char *blockname )
 {
-	int           lb, rc, status = EX_SUCCESS;
+	int           lb, end, skipped = 0, rc, status = EX_SUCCESS;
 	int           seek_flags = file ? DVDCSS_SEEK_KEY : DVDCSS_NOFLAGS;
 	int           read_flags = file ? DVDCSS_READ_DECRYPT : DVDCSS_NOFLAGS;
-	/* Aligned read buffer */
-	static unsigned char data[DVD_VIDEO_LB_LEN * 2];
-	unsigned char *buffer =
-		data + DVD_VIDEO_LB_LEN
-		     - ((long int)data & (DVD_VIDEO_LB_LEN-1));
 
 	if( block.size < 0 ) {
 		printe( 2, "%s: inva\n", blockname );
@@ -515,10 +1849,31 @@ static int copyblock( dvd_file_t *file, dvdcss_t dvdcss, int img,
 		printe( 2, "%s: null\n", blockname );
 		return status;
 	}
+	if( ! copy_buffer ) {
+		errno = posix_memalign( (void **)&copy_buffer, BUFFER_ALIGN, inplace ?
+		  (size_t)CHUNK_SECTORS * DVD_VIDEO_LB_LEN : slotsize( ) * (ring_depth ?
+		  ring_depth : uring_depth ? uring_depth : 1) );
+		if( errno ) {
+			copy_buffer = NULL;
+			printe( 1, "%s: memory allocation failed (%s)\n",
+			  blockname, strerror( errno ) );
+			return status | EX_MEM;
+		}
+		if( delta && (errno = posix_memalign( (void **)&copy_compare, BUFFER_ALIGN,
+		                                      (size_t)batch * DVD_VIDEO_LB_LEN )) ) {
+			copy_compare = NULL;
+			printe( 1, "%s: memory allocation failed (%s)\n",
+			  blockname, strerror( errno ) );
+			return status | EX_MEM;
+		}
+		if( uring_depth )
+			uringopen( &copy_uring );
+	}
 
 	/* Seek in the input */
 	if( dvdcss ) {
-		rc = dvdcss_seek( dvdcss, block.start, seek_flags );
+		rc = seek_flags & DVDCSS_SEEK_KEY ? seekdvdkey( dvdcss, block.start )
+		     : seekdvd( dvdcss, block.start, seek_flags );
 		if( rc < 0 ) {
 			printe( 1, "%s: seeking in the input (dvdcss%s) failed (%s)\n",
 			  blockname, seek_flags & DVDCSS_SEEK_KEY ? " key" : "",
@@ -530,60 +1885,2292 @@ static int copyblock( dvd_file_t *file, dvdcss_t dvdcss, int img,
 	printe( 2, "%s: ", blockname );
 	progress( -1 );
 
-	/* Seek to to the right position in the output image */
-	rc = ( lseek( img, (off_t)(block.start) * DVD_VIDEO_LB_LEN, SEEK_SET )
-	       == (off_t)(-1) );
-	if( rc ) {
-		progress( 101 );
-		printe( 1, "%s: seeking in the image failed (%s)\n",
-		  blockname, strerror( errno ) );
-		status |= EX_IO;
-		return status;
-	}
+	/* Copy chunk by chunk, skipping the chunks completed by a previous run */
+	for( lb = 0, progress( 0 ); lb < block.size; lb = end ) {
+		end = ! journal || block.size - lb < CHUNK_SECTORS ?
+		      block.size : lb + CHUNK_SECTORS;
+		if( journal && journaldone( block.start+lb, end-lb ) ) {
+			progress( percent( end, block.size ) );
+			skipped = 1;
+			continue;
+		}
+		if( dvdcss && skipped ) {
+			rc = seekdvd( dvdcss, block.start+lb, DVDCSS_NOFLAGS );
+			if( rc < 0 ) {
+				progress( 101 );
+				printe( 1, "%s: seeking in the input (dvdcss) failed (%s)\n",
+				  blockname, dvdcss_error( dvdcss ) );
+				return status | EX_IO;
+			}
+			skipped = 0;
+		}
 
-	for( lb = 0, progress( 0 ); lb < block.size; lb++ ) {
-		/* Read one sector (possibly decrypted) */
-		if( dvdcss )
-			rc = ( dvdcss_read( dvdcss, buffer, 1, read_flags ) != 1 );
+		if( inplace )
+			rc = inplaceblock( dvdcss, img, block, lb, end, 0, copy_buffer, blockname );
+		else if( map_io )
+			rc = mapblock( file, dvdcss, img, block, lb, end, read_flags, blockname );
+		else if( ring_depth && ! (file == NULL && copymode( )) )
+			rc = pipeblock( file, dvdcss, img, block, lb, end, read_flags,
+			                copy_buffer, copy_compare, blockname );
+		else if( copy_uring.fd >= 0 && ! (file == NULL && copymode( )) )
+			rc = uringblock( file, dvdcss, img, block, lb, end, read_flags,
+			                 copy_buffer, blockname, &copy_uring );
 		else
-			rc = ( DVDReadBlocks( file, lb, 1, buffer ) == (ssize_t)(-1) );
-		if( rc ) {
+			rc = syncblock( file, dvdcss, img, block, lb, end, read_flags,
+			                copy_buffer, copy_compare, blockname );
+		if( rc == EX_SUCCESS && journal )
+			rc = journalmark( img, block.start+lb, end-lb );
+		if( direct )
+			dropcache( block.start+lb, end-lb );
+		status |= rc;
+		if( rc != EX_SUCCESS )
+			return status;
+	}
+
+	progress( 100 );
+	return status;
+}
+
+/* Copy the sectors lb to end of a block, dvdcss being positioned at lb */
+/* An ordinary block is copied by the kernel when possible. */
+static int syncblock( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                      int lb, int end, int read_flags, unsigned char *buffer,
+                      unsigned char *compare, const char *blockname )
+{
+	int n, rc, kernel = file == NULL && copymode( ), status = EX_SUCCESS;
+
+	/* Second pass over the sectors that could not be read */
+	if( badsectors.retrying )
+		return retryblocks( file, dvdcss, img, block, lb, end, read_flags,
+		                    buffer, compare, blockname );
+
+	for( ; lb < end; lb += n ) {
+		n = end - lb < batch ? end - lb : batch;
+
+		if( kernel ) {
+			rc = kernelcopy( img, block.start+lb, n );
+			if( rc < n && copymode( ) && ! badmapfile ) {
+				progress( 101 );
+				printe( 1, "%s: copying sector %d failed (%s)\n",
+				  blockname, lb + rc, strerror( errno ) );
+				status |= EX_IO;
+				return status;
+			}
+			if( rc < n ) {
+				/* Not supported (or a read error to recover): go on with
+				 * the buffers */
+				kernel = 0;
+				if( seekdvd( dvdcss, block.start+lb+rc, DVDCSS_NOFLAGS ) < 0 ) {
+					progress( 101 );
+					printe( 1, "%s: seeking in the input (dvdcss) failed (%s)\n",
+					  blockname, dvdcss_error( dvdcss ) );
+					status |= EX_IO;
+					return status;
+				}
+				n = rc;
+			}
+			progress( percent( lb+n, block.size ) );
+			continue;
+		}
+
+		/* Read a batch of sectors (possibly decrypted) */
+		rc = readblocks( file, dvdcss, lb, n, read_flags, buffer );
+
+		/* Write the data that could be read at its position in the image */
+		if( rc > 0 && (rc = writeblocks( img, buffer, block.start+lb, rc, compare )) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, lb - rc - 1, strerror( errno ) );
+			status |= EX_IO;
+			return status;
+		}
+		if( rc < n && badmapfile ) {
+			/* Recover what can be read, then go on after the batch */
+			status |= recoverblocks( file, dvdcss, img, block, lb + rc, lb + n,
+			                         read_flags, buffer, compare, blockname );
+			if( status == EX_SUCCESS && dvdcss
+			    && seekdvd( dvdcss, block.start+lb+n, DVDCSS_NOFLAGS ) < 0 ) {
+				printe( 1, "%s: seeking in the input (dvdcss) failed (%s)\n",
+				  blockname, dvdcss_error( dvdcss ) );
+				status |= EX_IO;
+			}
+			if( status != EX_SUCCESS ) {
+				progress( 101 );
+				return status;
+			}
+		}
+		else if( rc < n ) {
 			progress( 101 );
 			if( file )
-				printe( 1, "%s: reading sector %d failed\n", blockname, lb );
+				printe( 1, "%s: reading sector %d failed\n", blockname, lb + rc );
 			status |= EX_IO;
 			return status;
 		}
+		progress( percent( lb+n, block.size ) );
+	}
 
-		/* Write the data */
-		rc = ( write( img, (void *)buffer, DVD_VIDEO_LB_LEN ) == (ssize_t)(-1) );
-		if( rc ) {
+	return status;
+}
+
+/* Copy the sectors lb to end of a block that are in the bad sector map of
+ * the previous run */
+static int retryblocks( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                        int lb, int end, int read_flags, unsigned char *buffer,
+                        unsigned char *compare, const char *blockname )
+{
+	const block_t *bad;
+	int           i, from, to, status = EX_SUCCESS;
+
+	for( i = 0; i < badsectors.retry_count && status == EX_SUCCESS; i++ ) {
+		bad = &badsectors.retry[i];
+		from = bad->start - block.start > lb ? bad->start - block.start : lb;
+		to = bad->start + bad->size - block.start < end ?
+		     bad->start + bad->size - block.start : end;
+		if( from < to )
+			status |= recoverblocks( file, dvdcss, img, block, from, to,
+			                         read_flags, buffer, compare, blockname );
+	}
+	if( status != EX_SUCCESS )
+		progress( 101 );
+	else
+		progress( percent( end, block.size ) );
+	return status;
+}
+
+/* Recover the sectors lb to end of a block, batch sectors at a time, within
+ * the time budget of the region */
+static int recoverblocks( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                          int lb, int end, int read_flags, unsigned char *buffer,
+                          unsigned char *compare, const char *blockname )
+{
+	struct timespec t0;
+	int             n, status = EX_SUCCESS;
+
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	for( ; lb < end && status == EX_SUCCESS; lb += n ) {
+		n = end - lb < batch ? end - lb : batch;
+		status |= recoverrange( file, dvdcss, img, block, lb, lb + n, read_flags,
+		                        buffer, compare, blockname, &t0 );
+	}
+	return status;
+}
+
+/* Read the sectors lb to end of a block, skipping each sector at which a read
+ * fails and going on after it; the sectors skipped are retried alone once the
+ * rest is read, then written as zeros and recorded as bad */
+/* A read that fails without reading anything does not tell which sector
+ * failed: the next reads are halved until one does or a single sector is
+ * left.  Once the time budget from t0 is spent, whatever is left is given
+ * up. */
+static int recoverrange( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                         int lb, int end, int read_flags, unsigned char *buffer,
+                         unsigned char *compare, const char *blockname,
+                         const struct timespec *t0 )
+{
+	int *skipped = NULL;
+	int n, rc, i, j, len = end - lb, count = 0, try, status = EX_SUCCESS;
+
+	/* Read forward over the failing sectors */
+	while( lb < end ) {
+		if( dvdcss && seekdvd( dvdcss, block.start+lb, DVDCSS_NOFLAGS ) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: seeking in the input (dvdcss) failed (%s)\n",
+			  blockname, dvdcss_error( dvdcss ) );
+			free( skipped );
+			return EX_IO;
+		}
+		n = end - lb < len ? end - lb : len;
+		rc = readblocks( file, dvdcss, lb, n, read_flags, buffer );
+		if( rc > 0 && (rc = writeblocks( img, buffer, block.start+lb, rc, compare )) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, lb - rc - 1, strerror( errno ) );
+			free( skipped );
+			return EX_IO;
+		}
+		lb += rc;
+		len = end - lb;
+		if( rc == n )
+			continue;
+
+		if( rc > 0 || n == 1 ) {
+			if( ! skipped && ! (skipped = malloc( (size_t)(end - lb) * sizeof( int ) )) ) {
+				printe( 1, "memory allocation failed\n" );
+				return EX_MEM;
+			}
+			skipped[count++] = lb++;
+			len--;
+		}
+		else
+			len = n / 2;
+		if( lb < end && budgetspent( t0 ) ) {
+			status = giveupblocks( img, block, lb, end, buffer, compare,
+			                       blockname );
+			break;
+		}
+	}
+
+	/* Retry the sectors skipped, keeping those still unreadable */
+	for( i = j = 0; i < count; i++ ) {
+		for( try = 0, rc = 0; rc < 1 && try < read_retries && ! budgetspent( t0 ); try++ ) {
+			if( dvdcss && seekdvd( dvdcss, block.start+skipped[i], DVDCSS_NOFLAGS ) < 0 )
+				continue;
+			rc = readblocks( file, dvdcss, skipped[i], 1, read_flags, buffer );
+		}
+		if( rc < 1 )
+			skipped[j++] = skipped[i];
+		else if( status == EX_SUCCESS
+		         && writeblocks( img, buffer, block.start+skipped[i], 1, compare ) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, skipped[i], strerror( errno ) );
+			status |= EX_IO;
+		}
+	}
+
+	/* Give up the runs of them left */
+	for( count = j, i = 0; i < count && status == EX_SUCCESS; i = j ) {
+		for( j = i+1; j < count && skipped[j] == skipped[j-1] + 1; j++ )
+			;
+		status |= giveupblocks( img, block, skipped[i], skipped[j-1] + 1,
+		                        buffer, compare, blockname );
+	}
+	free( skipped );
+	return status;
+}
+
+/* Check if the time budget of the recovery of a region started at t0 is spent */
+static int budgetspent( const struct timespec *t0 )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec - t0->tv_sec + (now.tv_nsec - t0->tv_nsec) / 1e9 >= read_budget;
+}
+
+/* Write the sectors lb to end of a block as zeros and record them as bad */
+static int giveupblocks( int img, block_t block, int lb, int end, unsigned char *buffer,
+                         unsigned char *compare, const char *blockname )
+{
+	int n, rc;
+
+	for( n = lb; n < end; n += rc ) {
+		rc = end - n < batch ? end - n : batch;
+		memset( buffer, 0, (size_t)rc * DVD_VIDEO_LB_LEN );
+		if( (rc = writeblocks( img, buffer, block.start+n, rc, compare )) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, n - rc - 1, strerror( errno ) );
+			return EX_IO;
+		}
+	}
+	progress( 101 );
+	printe( 2, "%s: sectors %d-%d unreadable\n", blockname, lb, end );
+	progress( -1 );
+	markbad( block.start+lb, end - lb );
+	return EX_SUCCESS;
+}
+
+/* Copy the sectors lb to end of a block, dvdcss being positioned at lb,
+ * reading them straight into a mapping of the image; an ordinary block is
+ * copied from a mapping of the DVD image file if it is one */
+/* The mappings cover at most MAP_SECTORS sectors at a time. */
+static int mapblock( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                     int lb, int end, int read_flags, const char *blockname )
+{
+	unsigned char *out, *in;
+	off_t         pos, base;
+	size_t        len;
+	long          page = sysconf( _SC_PAGESIZE );
+	int           n, i, count, rc;
+
+	for( ; lb < end; lb += n ) {
+		n = end - lb < MAP_SECTORS ? end - lb : MAP_SECTORS;
+		pos = (off_t)(block.start+lb) * DVD_VIDEO_LB_LEN;
+		base = pos & ~(off_t)(page-1);
+		len = (size_t)(pos - base) + (size_t)n * DVD_VIDEO_LB_LEN;
+		out = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, img, base );
+		if( out == MAP_FAILED ) {
+			progress( 101 );
+			printe( 1, "%s: mapping the image file failed (%s)\n",
+			  blockname, strerror( errno ) );
+			return EX_IO;
+		}
+		madvise( out, len, MADV_SEQUENTIAL );
+
+		if( file == NULL && dvdfd >= 0 ) {
+			in = mmap( NULL, len, PROT_READ, MAP_SHARED, dvdfd, base );
+			if( in == MAP_FAILED ) {
+				munmap( out, len );
+				progress( 101 );
+				printe( 1, "%s: mapping the DVD failed (%s)\n",
+				  blockname, strerror( errno ) );
+				return EX_IO;
+			}
+			madvise( in, len, MADV_SEQUENTIAL );
+			memcpy( out + (pos - base), in + (pos - base), (size_t)n * DVD_VIDEO_LB_LEN );
+			munmap( in, len );
+			statcount( OP_COPY, 1, (long long)n * DVD_VIDEO_LB_LEN );
+			rc = n;
+		}
+		else
+			/* Read batches of sectors (possibly decrypted) in place */
+			for( rc = 0; rc < n; rc += i ) {
+				i = n - rc < batch ? n - rc : batch;
+				count = readblocks( file, dvdcss, lb+rc, i, read_flags,
+				                    out + (pos - base) + (size_t)rc * DVD_VIDEO_LB_LEN );
+				if( count < i ) {
+					rc += count;
+					break;
+				}
+			}
+		if( hashes.units )
+			hashblocks( block.start+lb, rc, out + (pos - base) );
+
+		/* The pages of the window are written back before it is unmapped,
+		 * so that the errors are seen */
+		statcount( OP_WRITE, 1, (long long)rc * DVD_VIDEO_LB_LEN );
+		if( msync( out, len, MS_SYNC ) < 0 ) {
+			munmap( out, len );
 			progress( 101 );
 			printe( 1, "%s: writing sector %d failed (%s)\n",
 			  blockname, lb, strerror( errno ) );
+			return EX_IO;
+		}
+		if( munmap( out, len ) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, lb, strerror( errno ) );
+			return EX_IO;
+		}
+		if( rc < n ) {
+			progress( 101 );
+			if( file )
+				printe( 1, "%s: reading sector %d failed\n", blockname, lb + rc );
+			return EX_IO;
+		}
+		progress( percent( lb+n, block.size ) );
+	}
+
+	return EX_SUCCESS;
+}
+
+/* Copy the sectors lb to end of a block, dvdcss being positioned at lb, with
+ * up to uring_depth writes of a batch in flight while the next batches are
+ * read (and decrypted) */
+/* A write that io_uring does not complete is done again synchronously. */
+static int uringblock( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                       int lb, int end, int read_flags, unsigned char *buffer,
+                       const char *blockname, uring_t *uring )
+{
+	struct iovec  iov[URING_MAX];
+	unsigned char *data;
+	int           lbs[URING_MAX], free_slots[URING_MAX];
+	int           nfree, inflight = 0, slot, n, rc, done, status = EX_SUCCESS;
+
+	for( nfree = 0; nfree < uring_depth; nfree++ )
+		free_slots[nfree] = uring_depth - 1 - nfree;
+
+	while( lb < end || inflight ) {
+		/* Read a batch of sectors (possibly decrypted) into a free buffer
+		 * and queue its write */
+		if( lb < end && nfree > 0 ) {
+			slot = free_slots[--nfree];
+			data = buffer + slot * slotsize( );
+			n = end - lb < batch ? end - lb : batch;
+			rc = readblocks( file, dvdcss, lb, n, read_flags, data );
+			if( rc > 0 && hashes.units )
+				hashblocks( block.start+lb, rc, data );
+			iov[slot].iov_base = data;
+			iov[slot].iov_len = (size_t)(rc > 0 ? rc : 0) * DVD_VIDEO_LB_LEN;
+			lbs[slot] = lb;
+			if( rc > 0 && uringwrite( uring, img, &iov[slot], block.start+lb, slot ) == 0 )
+				inflight++;
+			else {
+				free_slots[nfree++] = slot;
+				if( rc > 0 && (done = writerun( img, data, block.start+lb, rc )) < 0 ) {
+					hashreset( block.start+lb, rc );
+					progress( 101 );
+					printe( 1, "%s: writing sector %d failed (%s)\n",
+					  blockname, lb - done - 1, strerror( errno ) );
+					status |= EX_IO;
+					lb = end;
+					continue;
+				}
+			}
+			if( rc < n ) {
+				progress( 101 );
+				if( file )
+					printe( 1, "%s: reading sector %d failed\n", blockname, lb + rc );
+				status |= EX_IO;
+				lb = end;
+			}
+			else
+				lb += n;
+			continue;
+		}
+
+		/* Wait for a write to complete; finish it synchronously if it is
+		 * short or failed */
+		rc = uringwait( uring, &slot );
+		if( slot < 0 ) {
+			if( ! status ) progress( 101 );
+			printe( 1, "%s: waiting for the writes failed (%s)\n",
+			  blockname, strerror( -rc ) );
+			uringdrain( uring, inflight );
+			return status | EX_IO;
+		}
+		inflight--;
+		free_slots[nfree++] = slot;
+		n = (int)(iov[slot].iov_len / DVD_VIDEO_LB_LEN);
+		done = rc > 0 ? rc / DVD_VIDEO_LB_LEN : 0;
+		if( done < n && (rc = writerun( img, (unsigned char *)iov[slot].iov_base
+		                                + (size_t)done * DVD_VIDEO_LB_LEN,
+		                                block.start+lbs[slot]+done, n-done )) < 0 ) {
+			hashreset( block.start+lbs[slot], n );
+			if( ! status ) progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, lbs[slot] + done - rc - 1, strerror( errno ) );
 			status |= EX_IO;
-			return status;
+			lb = end;
 		}
-		progress( (int)(lb*100/block.size) );
+		if( ! status )
+			progress( percent( lbs[slot]+n, block.size ) );
 	}
 
-	progress( 100 );
 	return status;
 }
 
-/* Test for file existence before open (to silence libdvdnav) */
-dvd_file_t *openfile( dvd_reader_t *dvd, int title, dvd_read_domain_t domain )
+/* Copy the sectors lb to end of a block with a reader thread filling a ring
+ * of ring_depth buffers while the calling thread writes them to the image */
+static int pipeblock( dvd_file_t *file, dvdcss_t dvdcss, int img, block_t block,
+                      int lb, int end, int read_flags, unsigned char *buffer,
+                      unsigned char *compare, const char *blockname )
 {
-	static dvd_stat_t stat;
-	if( ! DVDFileStat( dvd, title, domain, &stat ) )
-		return DVDOpenFile( dvd, title, domain );
+	static slot_t slots[RING_MAX];
+	ring_t        ring;
+	slot_t        *slot;
+	pthread_t     reader;
+	int           i, rc, last, status = EX_SUCCESS;
+
+	for( i = 0; i < ring_depth; i++ )
+		slots[i].data = buffer + i * slotsize( );
+	ring.slots = slots;
+	ring.head = ring.used = ring.stop = 0;
+	ring.file = file;
+	ring.dvdcss = dvdcss;
+	ring.lb = lb;
+	ring.end = end;
+	ring.read_flags = read_flags;
+	pthread_mutex_init( &ring.lock, NULL );
+	pthread_cond_init( &ring.cond, NULL );
+
+	rc = pthread_create( &reader, NULL, readerthread, &ring );
+	if( rc ) {
+		progress( 101 );
+		printe( 1, "%s: creation of the reader thread failed (%s)\n",
+		  blockname, strerror( rc ) );
+		status |= EX_MEM;
+		goto DESTROY;
+	}
+
+	for( ; ; ) {
+		/* Wait for a filled buffer */
+		pthread_mutex_lock( &ring.lock );
+		while( ring.used == 0 )
+			pthread_cond_wait( &ring.cond, &ring.lock );
+		slot = &slots[ring.head];
+		pthread_mutex_unlock( &ring.lock );
+
+		/* Write the data that could be read at its position in the image */
+		rc = slot->count;
+		if( rc > 0 && (rc = writeblocks( img, slot->data, block.start+slot->lb, rc,
+		                                 compare )) < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, slot->lb - rc - 1, strerror( errno ) );
+			status |= EX_IO;
+		}
+		else if( rc < slot->n ) {
+			progress( 101 );
+			if( file )
+				printe( 1, "%s: reading sector %d failed\n",
+				  blockname, slot->lb + rc );
+			status |= EX_IO;
+		}
+		else
+			progress( percent( slot->lb+slot->n, block.size ) );
+
+		/* Give the buffer back to the reader */
+		last = status || slot->lb + slot->n >= end;
+		pthread_mutex_lock( &ring.lock );
+		ring.head = (ring.head + 1) % ring_depth;
+		ring.used--;
+		ring.stop = last;
+		pthread_cond_signal( &ring.cond );
+		pthread_mutex_unlock( &ring.lock );
+		if( last ) break;
+	}
+
+	pthread_join( reader, NULL );
+DESTROY:
+	pthread_cond_destroy( &ring.cond );
+	pthread_mutex_destroy( &ring.lock );
+	return status;
+}
+
+/* Fill the buffers of the ring in order until the end of the block, a read
+ * error or a stop request by the writer */
+static void *readerthread( void *arg )
+{
+	ring_t *ring = arg;
+	slot_t *slot;
+	int    lb, n, tail, stop;
+
+	for( lb = ring->lb; lb < ring->end; lb += n ) {
+		n = ring->end - lb < batch ? ring->end - lb : batch;
+
+		/* Wait for a free buffer */
+		pthread_mutex_lock( &ring->lock );
+		while( ring->used == ring_depth && ! ring->stop )
+			pthread_cond_wait( &ring->cond, &ring->lock );
+		tail = (ring->head + ring->used) % ring_depth;
+		stop = ring->stop;
+		pthread_mutex_unlock( &ring->lock );
+		if( stop ) break;
+
+		/* Read a batch of sectors (possibly decrypted) */
+		slot = &ring->slots[tail];
+		slot->lb = lb;
+		slot->n = n;
+		slot->count = readblocks( ring->file, ring->dvdcss, lb, n,
+		                          ring->read_flags, slot->data );
+
+		/* Hand it to the writer */
+		pthread_mutex_lock( &ring->lock );
+		ring->used++;
+		pthread_cond_signal( &ring->cond );
+		pthread_mutex_unlock( &ring->lock );
+		if( slot->count < n ) break;
+	}
+
 	return NULL;
 }
 
+/* Decrypt in place the sectors lb to end (at most CHUNK_SECTORS) of a block,
+ * dvdcss being positioned at lb: only the runs of scrambled sectors are read
+ * again decrypted and written back, after the original chunk has been saved
+ * in the undo slot slot of the journal */
+static int inplaceblock( dvdcss_t dvdcss, int img, block_t block, int lb, int end,
+                         int slot, unsigned char *buffer, const char *blockname )
+{
+	int i, j, rc, n = end - lb, status = EX_SUCCESS;
+
+	/* Read the chunk as it is */
+	rc = readblocks( NULL, dvdcss, lb, n, DVDCSS_NOFLAGS, buffer );
+	if( rc < n ) {
+		progress( 101 );
+		printe( 1, "%s: reading sector %d failed\n", blockname, lb + rc );
+		return status | EX_IO;
+	}
+	for( i = 0; i < n; i++ )
+		if( isscrambled( buffer + (size_t)i * DVD_VIDEO_LB_LEN ) )
+			break;
+	if( i == n ) { /* nothing to do */
+		if( hashes.units )
+			hashblocks( block.start+lb, n, buffer );
+		progress( percent( end, block.size ) );
+		return status;
+	}
+
+	status |= journalbegin( slot, block.start+lb, n, buffer );
+	if( status ) {
+		progress( 101 );
+		return status;
+	}
+
+	for( ; i < n; i = j ) {
+		if( ! isscrambled( buffer + (size_t)i * DVD_VIDEO_LB_LEN ) ) {
+			j = i + 1;
+			continue;
+		}
+		for( j = i + 1; j < n; j++ )
+			if( ! isscrambled( buffer + (size_t)j * DVD_VIDEO_LB_LEN ) )
+				break;
+
+		/* Read the run again decrypted and write it back */
+		rc = seekdvd( dvdcss, block.start+lb+i, DVDCSS_NOFLAGS );
+		if( rc < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: seeking in the input (dvdcss) failed (%s)\n",
+			  blockname, dvdcss_error( dvdcss ) );
+			return status | EX_IO;
+		}
+		rc = readblocks( NULL, dvdcss, lb+i, j-i, DVDCSS_READ_DECRYPT,
+		                 buffer + (size_t)i * DVD_VIDEO_LB_LEN );
+		if( rc < j-i ) {
+			progress( 101 );
+			printe( 1, "%s: reading sector %d failed\n", blockname, lb+i + rc );
+			return status | EX_IO;
+		}
+		rc = writerun( img, buffer + (size_t)i * DVD_VIDEO_LB_LEN, block.start+lb+i, j-i );
+		if( rc < 0 ) {
+			progress( 101 );
+			printe( 1, "%s: writing sector %d failed (%s)\n",
+			  blockname, lb+i - rc - 1, strerror( errno ) );
+			return status | EX_IO;
+		}
+		progress( percent( lb+j, block.size ) );
+	}
+	if( hashes.units )
+		hashblocks( block.start+lb, n, buffer );
+
+	/* Position dvdcss for the next chunk */
+	if( seekdvd( dvdcss, block.start+end, DVDCSS_NOFLAGS ) < 0 ) {
+		progress( 101 );
+		printe( 1, "%s: seeking in the input (dvdcss) failed (%s)\n",
+		  blockname, dvdcss_error( dvdcss ) );
+		status |= EX_IO;
+	}
+	return status;
+}
+
+/* Read up to n sectors at lb in the block, from dvdcss at its current
+ * position or from file; return the number of sectors actually read */
+/* libdvdcss only descrambles the sectors flagged as scrambled; those which are
+ * still flagged after the decryption are counted. */
+static int readblocks( dvd_file_t *file, dvdcss_t dvdcss, int lb, int n,
+                       int read_flags, unsigned char *buffer )
+{
+	int     count, i, left = 0;
+	ssize_t rc;
+
+	for( count = 0; count < n; count += rc ) {
+		if( dvdcss )
+			rc = dvdcss_read( dvdcss, buffer + (size_t)count * DVD_VIDEO_LB_LEN,
+			                  n - count, read_flags );
+		else
+			rc = DVDReadBlocks( file, lb + count, n - count,
+			                    buffer + (size_t)count * DVD_VIDEO_LB_LEN );
+		statcount( OP_READ, 1, rc > 0 ? (long long)rc * DVD_VIDEO_LB_LEN : 0 );
+		if( rc <= 0 )
+			break;
+	}
+
+	if( read_flags & DVDCSS_READ_DECRYPT ) {
+		for( i = 0; i < count; i++ )
+			if( isscrambled( buffer + (size_t)i * DVD_VIDEO_LB_LEN ) )
+				left++;
+		if( left ) {
+			pthread_mutex_lock( &count_lock );
+			undecrypted += left;
+			pthread_mutex_unlock( &count_lock );
+		}
+	}
+
+	return count;
+}
+
+/* Write n sectors at sector position sector of img; return n, or -1-i if
+ * sector i could not be written (errno is then set) */
+/* In sparse mode the runs of zero sectors are skipped, or punched out of an
+ * image which had data before.  In delta mode compare holds a batch of the
+ * data already there. */
+static int writeblocks( int img, const unsigned char *buffer, int sector, int n,
+                        unsigned char *compare )
+{
+	int i, j, zero, rc;
+
+	if( delta ) {
+		rc = deltablocks( img, buffer, sector, n, compare );
+		if( rc == n && hashes.units )
+			hashblocks( sector, n, buffer );
+		return rc;
+	}
+	if( ! sparse ) {
+		rc = writerun( img, buffer, sector, n );
+		if( rc == n && hashes.units )
+			hashblocks( sector, n, buffer );
+		return rc;
+	}
+
+	for( i = 0; i < n; i = j ) {
+		zero = iszero( buffer + (size_t)i * DVD_VIDEO_LB_LEN );
+		for( j = i + 1; j < n; j++ )
+			if( iszero( buffer + (size_t)j * DVD_VIDEO_LB_LEN ) != zero )
+				break;
+
+		if( zero ) {
+			rc = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+			if( sparse_punch )
+				rc = fallocate( img, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				                (off_t)(sector+i) * DVD_VIDEO_LB_LEN,
+				                (off_t)(j-i) * DVD_VIDEO_LB_LEN );
+#else
+			rc = sparse_punch ? -1 : 0;
+#endif
+			if( rc == 0 ) {
+				pthread_mutex_lock( &count_lock );
+				sparse_bytes += (long long)(j-i) * DVD_VIDEO_LB_LEN;
+				pthread_mutex_unlock( &count_lock );
+				continue;
+			}
+			/* No hole punching: overwrite the old data */
+		}
+		rc = writerun( img, buffer + (size_t)i * DVD_VIDEO_LB_LEN, sector+i, j-i );
+		if( rc < 0 )
+			return rc - i;
+	}
+
+	if( hashes.units )
+		hashblocks( sector, n, buffer );
+	return n;
+}
+
+/* Write the runs of sectors among n at sector position sector of img that
+ * differ from the data already there (or are past its end), read into old;
+ * return as writeblocks() */
+static int deltablocks( int img, const unsigned char *buffer, int sector, int n,
+                        unsigned char *old )
+{
+	size_t        len = (size_t)n * DVD_VIDEO_LB_LEN, got;
+	ssize_t       rc;
+	int           i, j, same, valid;
+	long long     rewritten = 0;
+
+	/* The old data, read in one go */
+	for( got = 0; got < len; got += rc ) {
+		rc = pread( img, old + got, len - got, (off_t)sector * DVD_VIDEO_LB_LEN + got );
+		if( rc < 0 && errno == EINTR )
+			rc = 0;
+		else if( rc <= 0 )
+			break;
+	}
+	valid = got / DVD_VIDEO_LB_LEN;
+
+	for( i = 0; i < n; i = j ) {
+		same = i < valid && ! memcmp( buffer + (size_t)i * DVD_VIDEO_LB_LEN,
+		                              old + (size_t)i * DVD_VIDEO_LB_LEN, DVD_VIDEO_LB_LEN );
+		for( j = i + 1; j < n; j++ )
+			if( (j < valid && ! memcmp( buffer + (size_t)j * DVD_VIDEO_LB_LEN,
+			                            old + (size_t)j * DVD_VIDEO_LB_LEN,
+			                            DVD_VIDEO_LB_LEN )) != same )
+				break;
+		if( same )
+			continue;
+
+		rc = writerun( img, buffer + (size_t)i * DVD_VIDEO_LB_LEN, sector+i, j-i );
+		if( rc < 0 )
+			return rc - i;
+		rewritten += (long long)(j-i) * DVD_VIDEO_LB_LEN;
+	}
+
+	pthread_mutex_lock( &count_lock );
+	delta_bytes += rewritten;
+	delta_same += (long long)len - rewritten;
+	pthread_mutex_unlock( &count_lock );
+	return n;
+}
+
+/* Write n sectors at sector position sector of img; return n, or -1-i if
+ * sector i could not be written (errno is then set) */
+static int writerun( int img, const unsigned char *buffer, int sector, int n )
+{
+	size_t  len = (size_t)n * DVD_VIDEO_LB_LEN, done;
+	off_t   offset = (off_t)sector * DVD_VIDEO_LB_LEN;
+	ssize_t rc;
+	int     retried = 0;
+
+	/* A pipe is written in order, the sectors not written being zeros */
+	if( streaming && streamfill( img, offset ) < 0 )
+		return -1;
+
+	for( done = 0; done < len; done += rc ) {
+		if( streaming ) {
+			rc = write( img, (void *)(buffer + done), len - done );
+			if( rc > 0 )
+				stream_pos += rc;
+		}
+		else
+			rc = pwrite( img, (void *)(buffer + done), len - done, offset + done );
+		statcount( OP_WRITE, 1, rc > 0 ? rc : 0 );
+		if( rc < 0 && errno == EINTR )
+			rc = 0;
+#ifdef O_DIRECT
+		else if( rc < 0 && errno == EINVAL && direct && ! retried ) {
+			/* Not aligned as required by the device: go on through the
+			 * page cache */
+			pthread_mutex_lock( &count_lock );
+			rc = fcntl( img, F_GETFL );
+			if( rc >= 0 && (rc & O_DIRECT) ) {
+				printe( 2, "direct I/O not possible at sector %d\n",
+				  sector + (int)(done / DVD_VIDEO_LB_LEN) );
+				rc = fcntl( img, F_SETFL, rc & ~O_DIRECT );
+			}
+			pthread_mutex_unlock( &count_lock );
+			if( rc < 0 )
+				return -1 - (int)(done / DVD_VIDEO_LB_LEN);
+			retried = 1;
+			rc = 0;
+		}
+#endif
+		else if( rc <= 0 ) {
+			if( rc == 0 ) errno = EIO;
+			return -1 - (int)(done / DVD_VIDEO_LB_LEN);
+		}
+	}
+
+	return n;
+}
+
+/* Write zero sectors to the pipe img up to the byte offset; they are hashed
+ * as if they were copied; return 0, or -1 if it is already past offset or the
+ * writing failed (errno is then set) */
+static int streamfill( int img, off_t offset )
+{
+	static const unsigned char zeros[DVD_VIDEO_LB_LEN];
+	size_t  len;
+	ssize_t rc;
+
+	if( offset < stream_pos ) {
+		errno = ESPIPE;
+		return -1;
+	}
+	while( stream_pos < offset ) {
+		len = DVD_VIDEO_LB_LEN - stream_pos % DVD_VIDEO_LB_LEN;
+		if( (off_t)len > offset - stream_pos )
+			len = offset - stream_pos;
+		rc = write( img, zeros, len );
+		statcount( OP_WRITE, 1, rc > 0 ? rc : 0 );
+		if( rc < 0 && errno == EINTR )
+			continue;
+		if( rc <= 0 ) {
+			if( rc == 0 ) errno = EIO;
+			return -1;
+		}
+		if( hashes.units && stream_pos % DVD_VIDEO_LB_LEN == 0 && rc == DVD_VIDEO_LB_LEN )
+			hashblocks( stream_pos / DVD_VIDEO_LB_LEN, 1, zeros );
+		stream_pos += rc;
+	}
+	return 0;
+}
+
+/* Check if a sector is all zeros (a word-wide loop that can be vectorised) */
+static int iszero( const unsigned char *sector )
+{
+	const unsigned long *word = (const unsigned long *)sector;
+	unsigned long       acc = 0;
+	size_t              i;
+
+	for( i = 0; i < DVD_VIDEO_LB_LEN / sizeof( *word ); i++ )
+		acc |= word[i];
+
+	return acc == 0;
+}
+
+/* Check if a sector is scrambled (PES scrambling control bits) */
+static int isscrambled( const unsigned char *sector )
+{
+	return sector[ 0x14 ] & 0x30;
+}
+
+/* Get the kernel copy method in use, which the workers may lower */
+static int copymode( void )
+{
+	int mode;
+
+	pthread_mutex_lock( &count_lock );
+	mode = kernel_copy;
+	pthread_mutex_unlock( &count_lock );
+	return mode;
+}
+
+/* Lower the kernel copy method to mode (never raise it back) */
+static void lowercopy( int mode )
+{
+	pthread_mutex_lock( &count_lock );
+	if( kernel_copy > mode )
+		kernel_copy = mode;
+	pthread_mutex_unlock( &count_lock );
+}
+
+/* Copy n sectors at sector position sector of the DVD image file to the same
+ * position of img without going through user space; return the number of
+ * sectors copied, errno being set if it is less than n */
+/* If the kernel does not support it, kernel_copy is lowered (down to 0). */
+static int kernelcopy( int img, int sector, int n )
+{
+	size_t  len = (size_t)n * DVD_VIDEO_LB_LEN, done;
+	off_t   in, out;
+	ssize_t rc = -1;
+	int     mode;
+
+	for( done = 0; done < len; done += rc ) {
+		in = out = (off_t)sector * DVD_VIDEO_LB_LEN + done;
+		mode = copymode( );
+#if HAVE_COPY_FILE_RANGE
+		if( mode == 1 ) {
+			rc = copy_file_range( dvdfd, &in, img, &out, len - done, 0 );
+			statcount( OP_COPY, 1, rc > 0 ? rc : 0 );
+			if( rc < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+			               || errno == EOPNOTSUPP || errno == ESPIPE) ) {
+				lowercopy( mode = 2 );
+			}
+		}
+#endif
+#if HAVE_SENDFILE
+		if( mode == 2 ) {
+			/* The output is at the position of the image file */
+			pthread_mutex_lock( &sendfile_lock );
+			rc = streaming ? streamfill( img, out ) : lseek( img, out, SEEK_SET );
+			if( rc >= 0 )
+				rc = sendfile( img, dvdfd, &in, len - done );
+			if( rc > 0 && streaming )
+				stream_pos += rc;
+			statcount( OP_COPY, 1, rc > 0 ? rc : 0 );
+			pthread_mutex_unlock( &sendfile_lock );
+			if( rc < 0 && (errno == ENOSYS || errno == EINVAL) )
+				lowercopy( mode = 0 );
+		}
+#endif
+		if( mode == 0 )
+			break;
+		if( rc < 0 && errno == EINTR )
+			rc = 0;
+		else if( rc <= 0 ) {
+			if( rc == 0 ) errno = EIO;
+			break;
+		}
+	}
+
+	return done / DVD_VIDEO_LB_LEN;
+}
+
+/* Size of each buffer of a ring (pipeline or io_uring): a batch rounded up
+ * to BUFFER_ALIGN, so that all the buffers are aligned for O_DIRECT */
+static size_t slotsize( void )
+{
+	return ((size_t)batch * DVD_VIDEO_LB_LEN + BUFFER_ALIGN-1) & ~(size_t)(BUFFER_ALIGN-1);
+}
+
+/* Allocate size sectors for img (which may already have data) */
+static int preallocate( int img, int size )
+{
+#if HAVE_FALLOCATE
+	if( size > 0 && fallocate( img, 0, 0, (off_t)size * DVD_VIDEO_LB_LEN ) < 0 ) {
+		if( errno != EOPNOTSUPP ) {
+			printe( 1, "allocating the image file failed (%s)\n", strerror( errno ) );
+			return EX_IO;
+		}
+		printe( 2, "%s: no preallocation of the image file (%s)\n",
+		  progname, strerror( errno ) );
+	}
+#endif
+	return EX_SUCCESS;
+}
+
+/* Drop from the page cache the n sectors at sector position sector of the
+ * DVD image file once they are copied */
+static void dropcache( int sector, int n )
+{
+#if HAVE_POSIX_FADVISE
+	if( dvdfd >= 0 )
+		posix_fadvise( dvdfd, (off_t)sector * DVD_VIDEO_LB_LEN,
+		               (off_t)n * DVD_VIDEO_LB_LEN, POSIX_FADV_DONTNEED );
+#endif
+}
+
+/* Set up an io_uring instance of uring_depth entries; uring->fd is -1 if the
+ * kernel does not support it */
+static void uringopen( uring_t *uring )
+{
+#if HAVE_LINUX_IO_URING_H && defined( __NR_io_uring_setup )
+	struct io_uring_params params;
+	char                   *sq, *cq;
+
+	memset( &params, 0, sizeof( params ) );
+	uring->fd = (int)syscall( __NR_io_uring_setup, uring_depth, &params );
+	if( uring->fd < 0 ) {
+		printe( 2, "%s: no io_uring (%s), the writes are synchronous\n",
+		  progname, strerror( errno ) );
+		return;
+	}
+	uring->sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	uring->cq_size = params.cq_off.cqes
+	                 + params.cq_entries * sizeof( struct io_uring_cqe );
+	uring->sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+	uring->sq_ring = mmap( NULL, uring->sq_size, PROT_READ | PROT_WRITE,
+	                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING );
+	uring->cq_ring = mmap( NULL, uring->cq_size, PROT_READ | PROT_WRITE,
+	                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING );
+	uring->sqes = mmap( NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES );
+	if( uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED
+	    || uring->sqes == MAP_FAILED ) {
+		printe( 2, "%s: no io_uring (%s), the writes are synchronous\n",
+		  progname, strerror( errno ) );
+		uringclose( uring );
+		return;
+	}
+	sq = uring->sq_ring;
+	cq = uring->cq_ring;
+	uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+#else
+	uring->fd = -1;
+#endif
+}
+
+/* Release an io_uring instance */
+static void uringclose( uring_t *uring )
+{
+#if HAVE_LINUX_IO_URING_H && defined( __NR_io_uring_setup )
+	if( uring->fd < 0 ) return;
+	if( uring->sq_ring && uring->sq_ring != MAP_FAILED )
+		munmap( uring->sq_ring, uring->sq_size );
+	if( uring->cq_ring && uring->cq_ring != MAP_FAILED )
+		munmap( uring->cq_ring, uring->cq_size );
+	if( uring->sqes && uring->sqes != MAP_FAILED )
+		munmap( uring->sqes, uring->sqes_size );
+	close( uring->fd );
+	uring->fd = -1;
+#endif
+}
+
+/* Submit the write of the buffer iov at sector position sector of img, to be
+ * identified by slot on completion; return -1 if it cannot be submitted */
+static int uringwrite( uring_t *uring, int img, const struct iovec *iov,
+                       int sector, int slot )
+{
+#if HAVE_LINUX_IO_URING_H && defined( __NR_io_uring_setup )
+	struct io_uring_sqe *sqe;
+	unsigned            tail, index;
+	int                 rc;
+
+	tail = *uring->sq_tail;
+	index = tail & *uring->sq_mask;
+	sqe = &uring->sqes[index];
+	memset( sqe, 0, sizeof( *sqe ) );
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = img;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = 1;
+	sqe->off = (off_t)sector * DVD_VIDEO_LB_LEN;
+	sqe->user_data = slot;
+	uring->sq_array[index] = index;
+	__atomic_store_n( uring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+	statcount( OP_WRITE, 1, 0 );
+	do
+		rc = (int)syscall( __NR_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0 );
+	while( rc < 0 && errno == EINTR );
+	if( rc < 1 ) {
+		/* Take the entry back */
+		__atomic_store_n( uring->sq_tail, tail, __ATOMIC_RELEASE );
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* Wait for the completion of a write; return its result (the number of bytes
+ * written or -errno) and set slot (to -1 if the wait failed) */
+static int uringwait( uring_t *uring, int *slot )
+{
+#if HAVE_LINUX_IO_URING_H && defined( __NR_io_uring_setup )
+	struct io_uring_cqe *cqe;
+	unsigned            head;
+	int                 rc;
+
+	head = *uring->cq_head;
+	while( head == __atomic_load_n( uring->cq_tail, __ATOMIC_ACQUIRE ) ) {
+		rc = (int)syscall( __NR_io_uring_enter, uring->fd, 0, 1,
+		                   IORING_ENTER_GETEVENTS, NULL, 0 );
+		if( rc < 0 && errno != EINTR ) {
+			*slot = -1;
+			return -errno;
+		}
+	}
+	cqe = &uring->cqes[head & *uring->cq_mask];
+	*slot = (int)cqe->user_data;
+	rc = cqe->res;
+	statcount( OP_WRITE, 0, rc > 0 ? rc : 0 );
+	__atomic_store_n( uring->cq_head, head + 1, __ATOMIC_RELEASE );
+	return rc;
+#else
+	*slot = -1;
+	return -ENOSYS;
+#endif
+}
+
+/* Wait for the n writes still in flight once uringwait() has failed, so that
+ * their buffers can be reused; the completion queue is polled */
+static void uringdrain( uring_t *uring, int n )
+{
+#if HAVE_LINUX_IO_URING_H && defined( __NR_io_uring_setup )
+	struct timespec pause = { 0, 1000000 };
+	unsigned        head;
+
+	for( head = *uring->cq_head; n > 0; ) {
+		if( head == __atomic_load_n( uring->cq_tail, __ATOMIC_ACQUIRE ) ) {
+			nanosleep( &pause, NULL );
+			continue;
+		}
+		statcount( OP_WRITE, 0, uring->cqes[head & *uring->cq_mask].res > 0 ?
+		           uring->cqes[head & *uring->cq_mask].res : 0 );
+		__atomic_store_n( uring->cq_head, ++head, __ATOMIC_RELEASE );
+		n--;
+	}
+#endif
+}
+
+/* Load the sector ranges recorded in the journal file, and keep it open for
+ * appending; its first line records the size of the DVD (and the in place
+ * mode) */
+/* In place, the chunks being decrypted are recorded by a line "- start size
+ * slot", their original data being in the slot slot of the file
+ * journalfile.undo. */
+static int openjournal( const char *journalfile, int size )
+{
+	block_t *done;
+	char    line[64], mode[16] = "", *undofile;
+	int     start, count, slot, i, jsize = -1;
+
+	journal = fopen( journalfile, "a+" );
+	if( journal == NULL ) {
+		printe( 1, "opening of the journal (%s) failed (%s)\n",
+		  journalfile, strerror( errno ) );
+		return EX_OPEN;
+	}
+
+	rewind( journal );
+	if( ! fgets( line, sizeof( line ), journal ) ) {
+		fprintf( journal, "dvdimgdecss journal %d%s\n", size, inplace ? " inplace" : "" );
+		jsize = size;
+		if( inplace ) strcpy( mode, "inplace" );
+	}
+	else if( sscanf( line, "dvdimgdecss journal %d %15s", &jsize, mode ) < 1 ) {
+		printe( 1, "%s: not a journal\n", journalfile );
+		goto ERROR;
+	}
+	if( jsize != size ) {
+		printe( 1, "%s: journal of another DVD (%d sectors)\n", journalfile, jsize );
+		goto ERROR;
+	}
+	if( !inplace != !*mode ) {
+		printe( 1, "%s: journal of a run %s place\n", journalfile,
+		  inplace ? "out of" : "in" );
+		goto ERROR;
+	}
+	/* A truncated last line is the sign of a crash: its range is redone */
+	while( fgets( line, sizeof( line ), journal ) ) {
+		if( ! strchr( line, '\n' ) ) {
+			fputc( '\n', journal );
+			break;
+		}
+		if( sscanf( line, "- %d %d %d", &start, &count, &slot ) == 3
+		    && slot >= 0 && slot < JOBS_MAX ) {
+			journal_ranges.pending[slot].start = start;
+			journal_ranges.pending[slot].size = count;
+			continue;
+		}
+		if( sscanf( line, "%d %d", &start, &count ) != 2 )
+			continue;
+		for( i = 0; i < JOBS_MAX; i++ )
+			if( journal_ranges.pending[i].start == start
+			    && journal_ranges.pending[i].size == count )
+				journal_ranges.pending[i].size = 0;
+		if( journal_ranges.count == journal_ranges.alloc ) {
+			journal_ranges.alloc = journal_ranges.alloc ? journal_ranges.alloc * 2 : 256;
+			done = realloc( journal_ranges.done, journal_ranges.alloc * sizeof( block_t ) );
+			if( ! done ) {
+				printe( 1, "memory allocation failed\n" );
+				fclose( journal );
+				journal = NULL;
+				return EX_MEM;
+			}
+			journal_ranges.done = done;
+		}
+		journal_ranges.done[journal_ranges.count].start = start;
+		journal_ranges.done[journal_ranges.count++].size = count;
+	}
+
+	printe( 2, "%s: %d chunks already done\n", journalfile, journal_ranges.count );
+
+	if( inplace ) {
+		undofile = malloc( strlen( journalfile ) + sizeof( ".undo" ) );
+		if( ! undofile ) {
+			printe( 1, "memory allocation failed\n" );
+			fclose( journal );
+			journal = NULL;
+			return EX_MEM;
+		}
+		sprintf( undofile, "%s.undo", journalfile );
+		journal_undo = open( undofile, O_RDWR | O_CREAT,
+		  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH );
+		if( journal_undo < 0 ) {
+			printe( 1, "opening of the undo file (%s) failed (%s)\n",
+			  undofile, strerror( errno ) );
+			free( undofile );
+			goto ERROR;
+		}
+		free( undofile );
+	}
+	return EX_SUCCESS;
+
+ERROR:
+	fclose( journal );
+	journal = NULL;
+	return EX_OPEN;
+}
+
+/* Remove the journal of a completed decryption in place, and its undo file */
+static int removejournal( const char *journalfile )
+{
+	char *undofile;
+	int  status = EX_SUCCESS;
+
+	undofile = malloc( strlen( journalfile ) + sizeof( ".undo" ) );
+	if( ! undofile ) {
+		printe( 1, "memory allocation failed\n" );
+		return EX_MEM;
+	}
+	sprintf( undofile, "%s.undo", journalfile );
+	if( unlink( journalfile ) < 0 || unlink( undofile ) < 0 ) {
+		printe( 1, "removing the journal (%s) failed (%s)\n",
+		  journalfile, strerror( errno ) );
+		status = EX_IO;
+	}
+	free( undofile );
+	return status;
+}
+
+/* Check if a sector range was recorded as done in the journal */
+static int journaldone( int start, int size )
+{
+	int i;
+
+	/* The sectors to retry are not done */
+	if( badsectors.retrying && badoverlap( start, size ) )
+		return 0;
+
+	for( i = 0; i < journal_ranges.count; i++ )
+		if( journal_ranges.done[i].start <= start
+		    && journal_ranges.done[i].start + journal_ranges.done[i].size >= start + size )
+			return 1;
+
+	return 0;
+}
+
+/* Record a sector range as done in the journal, once it is on disk */
+static int journalmark( int img, int start, int size )
+{
+	int status = EX_SUCCESS;
+
+	statcount( OP_SYNC, 2, 0 );
+	if( fdatasync( img ) < 0 ) {
+		printe( 1, "synchronizing the image failed (%s)\n", strerror( errno ) );
+		return EX_IO;
+	}
+
+	pthread_mutex_lock( &journal_ranges.lock );
+	if( fprintf( journal, "%d %d\n", start, size ) < 0
+	    || fflush( journal ) == EOF || fsync( fileno( journal ) ) < 0 ) {
+		printe( 1, "writing to the journal failed (%s)\n", strerror( errno ) );
+		status |= EX_IO;
+	}
+	pthread_mutex_unlock( &journal_ranges.lock );
+
+	return status;
+}
+
+/* Save the original data of a chunk about to be decrypted in place in the undo
+ * slot slot, and record it in the journal */
+static int journalbegin( int slot, int start, int size, const unsigned char *buffer )
+{
+	int status = EX_SUCCESS;
+
+	statcount( OP_SYNC, 2, 0 );
+	if( writerun( journal_undo, buffer, slot * CHUNK_SECTORS, size ) < 0
+	    || fdatasync( journal_undo ) < 0 ) {
+		printe( 1, "writing to the undo file failed (%s)\n", strerror( errno ) );
+		return EX_IO;
+	}
+
+	pthread_mutex_lock( &journal_ranges.lock );
+	if( fprintf( journal, "- %d %d %d\n", start, size, slot ) < 0
+	    || fflush( journal ) == EOF || fsync( fileno( journal ) ) < 0 ) {
+		printe( 1, "writing to the journal failed (%s)\n", strerror( errno ) );
+		status |= EX_IO;
+	}
+	pthread_mutex_unlock( &journal_ranges.lock );
+
+	return status;
+}
+
+/* Put back the original data of the chunks that were being decrypted in place
+ * when the previous run was interrupted, so that they are decrypted again;
+ * each restored slot is cleared in the journal ("- start 0 slot") before it
+ * can be reused, lest a later crash restore it over another chunk */
+static int journalrestore( int img )
+{
+	unsigned char *buffer;
+	block_t       *pending;
+	int           slot, rc, status = EX_SUCCESS;
+
+	for( slot = 0; slot < JOBS_MAX; slot++ ) {
+		pending = &journal_ranges.pending[slot];
+		if( pending->size <= 0 || pending->size > CHUNK_SECTORS )
+			continue;
+		printe( 2, "restoring sectors %d-%d from the undo file\n",
+		  pending->start, pending->start+pending->size );
+
+		buffer = malloc( (size_t)pending->size * DVD_VIDEO_LB_LEN );
+		if( ! buffer ) {
+			printe( 1, "memory allocation failed\n" );
+			return status | EX_MEM;
+		}
+		rc = pread( journal_undo, buffer, (size_t)pending->size * DVD_VIDEO_LB_LEN,
+		            (off_t)slot * CHUNK_SECTORS * DVD_VIDEO_LB_LEN );
+		if( rc != pending->size * DVD_VIDEO_LB_LEN ) {
+			printe( 1, "reading of the undo file failed (%s)\n",
+			  rc < 0 ? strerror( errno ) : "truncated" );
+			status |= EX_IO;
+		}
+		else if( writerun( img, buffer, pending->start, pending->size ) < 0
+		         || fdatasync( img ) < 0 ) {
+			printe( 1, "restoring of sectors %d-%d failed (%s)\n",
+			  pending->start, pending->start+pending->size, strerror( errno ) );
+			status |= EX_IO;
+		}
+		else if( fprintf( journal, "- %d 0 %d\n", pending->start, slot ) < 0
+		         || fflush( journal ) == EOF || fsync( fileno( journal ) ) < 0 ) {
+			printe( 1, "writing to the journal failed (%s)\n", strerror( errno ) );
+			status |= EX_IO;
+		}
+		free( buffer );
+		if( status ) break;
+		pending->size = 0;
+	}
+
+	return status;
+}
+
+/* Record n unreadable sectors at sector position start */
+static void markbad( int start, int n )
+{
+	block_t *bad;
+
+	pthread_mutex_lock( &badsectors.lock );
+	if( badsectors.count == badsectors.alloc ) {
+		badsectors.alloc = badsectors.alloc ? badsectors.alloc * 2 : 64;
+		bad = realloc( badsectors.bad, badsectors.alloc * sizeof( block_t ) );
+		if( ! bad ) {
+			/* Still zero in the image, just not in the map */
+			badsectors.alloc = badsectors.count;
+			pthread_mutex_unlock( &badsectors.lock );
+			printe( 1, "memory allocation failed\n" );
+			return;
+		}
+		badsectors.bad = bad;
+	}
+	badsectors.bad[badsectors.count].start = start;
+	badsectors.bad[badsectors.count++].size = n;
+	pthread_mutex_unlock( &badsectors.lock );
+}
+
+/* Whether n sectors at sector position start are to be retried */
+static int badoverlap( int start, int n )
+{
+	int i;
+
+	for( i = 0; i < badsectors.retry_count; i++ )
+		if( badsectors.retry[i].start < start + n
+		    && badsectors.retry[i].start + badsectors.retry[i].size > start )
+			return 1;
+	return 0;
+}
+
+/* Read the bad sector map of a previous run, if there is one; only its
+ * sectors are then copied */
+static int openbadmap( const char *badmapfile, int size )
+{
+	FILE    *badmap;
+	block_t *retry;
+	char    line[64];
+	int     start, count, msize = -1, status = EX_SUCCESS;
+
+	badmap = fopen( badmapfile, "r" );
+	if( badmap == NULL ) {
+		if( errno == ENOENT )
+			return EX_SUCCESS;
+		printe( 1, "opening of the bad sector map (%s) failed (%s)\n",
+		  badmapfile, strerror( errno ) );
+		return EX_OPEN;
+	}
+
+	if( ! fgets( line, sizeof( line ), badmap )
+	    || sscanf( line, "dvdimgdecss bad sectors %d", &msize ) != 1 ) {
+		printe( 1, "%s: not a bad sector map\n", badmapfile );
+		status = EX_OPEN;
+	}
+	else if( msize != size ) {
+		printe( 1, "%s: bad sector map of another DVD (%d sectors)\n",
+		  badmapfile, msize );
+		status = EX_OPEN;
+	}
+	while( status == EX_SUCCESS && fgets( line, sizeof( line ), badmap ) ) {
+		if( sscanf( line, "%d %d", &start, &count ) != 2
+		    || start < 0 || count <= 0 || start + count > size )
+			continue;
+		if( badsectors.retry_count % 64 == 0 ) {
+			retry = realloc( badsectors.retry,
+			                 (badsectors.retry_count + 64) * sizeof( block_t ) );
+			if( ! retry ) {
+				printe( 1, "memory allocation failed\n" );
+				status = EX_MEM;
+				break;
+			}
+			badsectors.retry = retry;
+		}
+		badsectors.retry[badsectors.retry_count].start = start;
+		badsectors.retry[badsectors.retry_count++].size = count;
+	}
+	fclose( badmap );
+
+	badsectors.retrying = status == EX_SUCCESS;
+	if( badsectors.retrying )
+		printe( 2, "%s: retrying %d ranges of sectors\n",
+		  badmapfile, badsectors.retry_count );
+	return status;
+}
+
+/* Write the sectors that could not be read, merged into ranges; the map is
+ * removed when there are none */
+static int writebadmap( const char *badmapfile, int size )
+{
+	FILE *badmap;
+	int  i, j, sectors = 0;
+
+	if( badsectors.count == 0 ) {
+		if( unlink( badmapfile ) < 0 && errno != ENOENT ) {
+			printe( 1, "removing of the bad sector map (%s) failed (%s)\n",
+			  badmapfile, strerror( errno ) );
+			return EX_IO;
+		}
+		return EX_SUCCESS;
+	}
+
+	qsort( badsectors.bad, badsectors.count, sizeof( block_t ), cmpblocks );
+	for( i = 0, j = 0; i < badsectors.count; i++ ) {
+		if( j > 0 && badsectors.bad[j-1].start + badsectors.bad[j-1].size
+		             >= badsectors.bad[i].start )
+			badsectors.bad[j-1].size = badsectors.bad[i].start + badsectors.bad[i].size
+			                           - badsectors.bad[j-1].start;
+		else
+			badsectors.bad[j++] = badsectors.bad[i];
+	}
+	badsectors.count = j;
+
+	badmap = fopen( badmapfile, "w" );
+	if( badmap == NULL ) {
+		printe( 1, "opening of the bad sector map (%s) failed (%s)\n",
+		  badmapfile, strerror( errno ) );
+		return EX_OPEN;
+	}
+	fprintf( badmap, "dvdimgdecss bad sectors %d\n", size );
+	for( i = 0; i < badsectors.count; i++ ) {
+		fprintf( badmap, "%d %d\n", badsectors.bad[i].start, badsectors.bad[i].size );
+		sectors += badsectors.bad[i].size;
+	}
+	if( fclose( badmap ) != 0 ) {
+		printe( 1, "writing of the bad sector map (%s) failed (%s)\n",
+		  badmapfile, strerror( errno ) );
+		return EX_IO;
+	}
+
+	printe( 1, "%d sectors unreadable, recorded in %s\n", sectors, badmapfile );
+	return EX_IO;
+}
+
+static int cmpblocks( const void *a, const void *b )
+{
+	return ((const block_t *)a)->start - ((const block_t *)b)->start;
+}
+
+/* Cut the extents of the map into hash units */
+static int makeunits( const extmap_t *map )
+{
+	const block_t *block;
+	hashunit_t    *unit;
+	int           i, lb, count = 0;
+
+	for( i = 0; i < map->count; i++ )
+		count += (map->extents[i].block.size + CHUNK_SECTORS-1) / CHUNK_SECTORS;
+	hashes.units = malloc( (count ? count : 1) * sizeof( hashunit_t ) );
+	if( ! hashes.units ) {
+		printe( 1, "memory allocation failed\n" );
+		return EX_MEM;
+	}
+
+	for( i = 0; i < map->count; i++ ) {
+		block = &map->extents[i].block;
+		for( lb = 0; lb < block->size; lb += CHUNK_SECTORS ) {
+			unit = &hashes.units[hashes.count++];
+			unit->start = block->start + lb;
+			unit->size = block->size - lb < CHUNK_SECTORS ? block->size - lb : CHUNK_SECTORS;
+			unit->next = -1;
+		}
+	}
+
+	return EX_SUCCESS;
+}
+
+/* Return the hash unit containing sector, or NULL */
+static hashunit_t *findunit( int sector )
+{
+	int lo = 0, hi = hashes.count - 1, mid;
+
+	while( lo <= hi ) {
+		mid = (lo + hi) / 2;
+		if( sector < hashes.units[mid].start )
+			hi = mid - 1;
+		else if( sector >= hashes.units[mid].start + hashes.units[mid].size )
+			lo = mid + 1;
+		else
+			return &hashes.units[mid];
+	}
+	return NULL;
+}
+
+/* Hash n sectors at sector position sector as they are written */
+/* A unit is only ever hashed by one thread at a time, from its start and in
+ * order; a unit hashed out of order is left incomplete (it is hashed from the
+ * image at the end). */
+static void hashblocks( int sector, int n, const unsigned char *buffer )
+{
+	hashunit_t *unit;
+	int        m;
+
+	for( ; n > 0; sector += m, n -= m, buffer += (size_t)m * DVD_VIDEO_LB_LEN ) {
+		unit = findunit( sector );
+		if( ! unit ) return;
+		m = unit->start + unit->size - sector;
+		if( m > n ) m = n;
+
+		if( sector == unit->start ) {
+			unit->next = sector;
+			unit->crc = 0;
+			sha256init( &unit->sha );
+		}
+		if( unit->next != sector ) {
+			unit->next = -1;
+			continue;
+		}
+		unit->crc = crc32c( unit->crc, buffer, (size_t)m * DVD_VIDEO_LB_LEN );
+		sha256update( &unit->sha, buffer, (size_t)m * DVD_VIDEO_LB_LEN );
+		unit->next += m;
+		if( unit->next == unit->start + unit->size )
+			sha256final( &unit->sha, unit->digest );
+	}
+}
+
+/* Mark the units of n sectors at sector position sector as incomplete (their
+ * data could not be written) */
+static void hashreset( int sector, int n )
+{
+	hashunit_t *unit;
+
+	if( ! hashes.units ) return;
+	for( ; n > 0; n -= unit->start + unit->size - sector, sector = unit->start + unit->size ) {
+		unit = findunit( sector );
+		if( ! unit ) return;
+		unit->next = -1;
+	}
+}
+
+/* Hash a unit from the file fd with a buffer of batch sectors */
+static int hashfile( int fd, hashunit_t *unit, unsigned char *buffer )
+{
+	size_t  len;
+	ssize_t rc;
+	int     lb, n;
+
+	unit->crc = 0;
+	sha256init( &unit->sha );
+	for( lb = 0; lb < unit->size; lb += n ) {
+		n = unit->size - lb < batch ? unit->size - lb : batch;
+		len = (size_t)n * DVD_VIDEO_LB_LEN;
+		rc = pread( fd, buffer, len, (off_t)(unit->start+lb) * DVD_VIDEO_LB_LEN );
+		if( rc < 0 && errno == EINTR ) {
+			n = 0;
+			continue;
+		}
+		if( rc != (ssize_t)len ) {
+			printe( 1, "reading sector %d failed (%s)\n", unit->start+lb,
+			  rc < 0 ? strerror( errno ) : "end of file" );
+			unit->next = -1;
+			return EX_IO;
+		}
+		unit->crc = crc32c( unit->crc, buffer, len );
+		sha256update( &unit->sha, buffer, len );
+	}
+	sha256final( &unit->sha, unit->digest );
+	unit->next = unit->start + unit->size;
+
+	return EX_SUCCESS;
+}
+
+/* Write the manifest of the image: the digests of each unit, of each extent
+ * of the map and of the whole image; the units that were not hashed while
+ * copying are hashed from the image first */
+/* The CRC32C of an extent (of the image) is that of its data, combined from
+ * those of its units; its SHA-256 is that of the SHA-256 of its units. */
+static int writemanifest( const char *manifestfile, const char *imgfile,
+                          const extmap_t *map, int size )
+{
+	FILE          *manifest;
+	unsigned char *buffer = NULL, digest[32];
+	sha256_t      extent_sha, image_sha;
+	uint32_t      extent_crc, image_crc = 0;
+	hashunit_t    *unit;
+	const extent_t *extent;
+	char          name[24];
+	int           img = -1, i, u, rehashed = 0, status = EX_SUCCESS;
+
+	for( u = 0; u < hashes.count; u++ ) {
+		unit = &hashes.units[u];
+		if( unit->next == unit->start + unit->size ) continue;
+		if( img < 0 ) {
+			img = open( imgfile, O_RDONLY );
+			errno = img < 0 ? errno
+			        : posix_memalign( (void **)&buffer, BUFFER_ALIGN,
+			                          (size_t)batch * DVD_VIDEO_LB_LEN );
+			if( img < 0 || errno ) {
+				printe( 1, "hashing of the image file (%s) failed (%s)\n",
+				  imgfile, strerror( errno ) );
+				if( img >= 0 ) close( img );
+				return EX_IO;
+			}
+		}
+		status |= hashfile( img, unit, buffer );
+		rehashed++;
+	}
+	if( img >= 0 ) {
+		close( img );
+		free( buffer );
+		printe( 2, "%d chunks hashed from the image file\n", rehashed );
+	}
+	if( status ) {
+		printe( 1, "no manifest written\n" );
+		return status;
+	}
+
+	manifest = fopen( manifestfile, "w" );
+	if( ! manifest ) {
+		printe( 1, "opening of the manifest (%s) failed (%s)\n",
+		  manifestfile, strerror( errno ) );
+		return EX_OPEN;
+	}
+	fprintf( manifest, "# %s manifest\nsize %d\n", progname, size );
+
+	sha256init( &image_sha );
+	for( i = 0, u = 0; i < map->count; i++ ) {
+		extent = &map->extents[i];
+		extent_crc = 0;
+		sha256init( &extent_sha );
+		for( ; u < hashes.count && hashes.units[u].start < extent->block.start
+		                                                   + extent->block.size; u++ ) {
+			unit = &hashes.units[u];
+			fprintf( manifest, "chunk %d %d", unit->start, unit->size );
+			writedigest( manifest, NULL, unit->crc, unit->digest );
+			extent_crc = crc32ccombine( extent_crc, unit->crc,
+			                            (long long)unit->size * DVD_VIDEO_LB_LEN );
+			sha256update( &extent_sha, unit->digest, 32 );
+			sha256update( &image_sha, unit->digest, 32 );
+		}
+		if( extent->title == GAP )
+			snprintf( name, 24, "Block %08x-%08x",
+			  extent->block.start, extent->block.start+extent->block.size );
+		else
+			snprintf( name, 24, "Title %02d %s", extent->title,
+			  domainname( extent->domain ) );
+		sha256final( &extent_sha, digest );
+		fprintf( manifest, "extent %d %d", extent->block.start, extent->block.size );
+		writedigest( manifest, name, extent_crc, digest );
+		image_crc = crc32ccombine( image_crc, extent_crc,
+		                           (long long)extent->block.size * DVD_VIDEO_LB_LEN );
+	}
+	sha256final( &image_sha, digest );
+	fprintf( manifest, "image" );
+	writedigest( manifest, NULL, image_crc, digest );
+
+	if( ferror( manifest ) | (fclose( manifest ) == EOF) ) {
+		printe( 1, "writing of the manifest (%s) failed (%s)\n",
+		  manifestfile, strerror( errno ) );
+		status |= EX_IO;
+	}
+	return status;
+}
+
+/* Write the end of a line of the manifest: the digests and the name */
+static int writedigest( FILE *manifest, const char *name, uint32_t crc,
+                         const unsigned char *digest )
+{
+	int i;
+
+	fprintf( manifest, " %08x ", crc );
+	for( i = 0; i < 32; i++ )
+		fprintf( manifest, "%02x", digest[i] );
+	return fprintf( manifest, "%s%s\n", name ? " " : "", name ? name : "" );
+}
+
+/* Check an image file against a manifest: the units are hashed from the image
+ * by jobs threads, and the digests of the extents and of the image are checked
+ * against those of the units */
+static int verifymanifest( const char *manifestfile, const char *imgfile )
+{
+	verify_t      verify;
+	pthread_t     threads[JOBS_MAX];
+	FILE          *manifest;
+	char          line[256];
+	unsigned char digest[32], computed[32];
+	sha256_t      extent_sha, image_sha;
+	uint32_t      crc, extent_crc = 0, image_crc = 0;
+	hashunit_t    *unit;
+	struct stat   imgstat;
+	int           start, n, size = -1, lineno = 0, pos, i, rc, status = EX_SUCCESS;
+
+	manifest = fopen( manifestfile, "r" );
+	if( ! manifest ) {
+		printe( 1, "opening of the manifest (%s) failed (%s)\n",
+		  manifestfile, strerror( errno ) );
+		return EX_OPEN;
+	}
+	memset( &verify, 0, sizeof( verify ) );
+	sha256init( &extent_sha );
+	sha256init( &image_sha );
+
+	/* Load the units, and check the extents and the image */
+	while( fgets( line, sizeof( line ), manifest ) ) {
+		lineno++;
+		line[strcspn( line, "\n" )] = '\0';
+		if( line[0] == '#' || sscanf( line, "size %d", &size ) == 1 )
+			continue;
+		pos = i = 0;
+		if( sscanf( line, "chunk %d %d%n", &start, &n, &pos ) == 2
+		    && (i = parsedigest( line + pos, &crc, digest )) ) {
+			if( verify.count % 64 == 0 ) {
+				unit = realloc( verify.units, (verify.count + 64) * sizeof( hashunit_t ) );
+				if( ! unit ) {
+					printe( 1, "memory allocation failed\n" );
+					status |= EX_MEM;
+					break;
+				}
+				verify.units = unit;
+			}
+			unit = &verify.units[verify.count++];
+			unit->start = start;
+			unit->size = n;
+			unit->crc = crc;
+			memcpy( unit->digest, digest, 32 );
+			extent_crc = crc32ccombine( extent_crc, crc, (long long)n * DVD_VIDEO_LB_LEN );
+			sha256update( &extent_sha, digest, 32 );
+			sha256update( &image_sha, digest, 32 );
+		}
+		else if( sscanf( line, "extent %d %d%n", &start, &n, &pos ) == 2
+		         && (i = parsedigest( line + pos, &crc, digest )) ) {
+			sha256final( &extent_sha, computed );
+			if( crc != extent_crc || memcmp( digest, computed, 32 ) ) {
+				printe( 1, "ERROR %s: inconsistent manifest\n", line + pos + i + 1 );
+				status |= EX_MISMATCH;
+			}
+			image_crc = crc32ccombine( image_crc, extent_crc,
+			                           (long long)n * DVD_VIDEO_LB_LEN );
+			extent_crc = 0;
+			sha256init( &extent_sha );
+		}
+		else if( strncmp( line, "image", 5 ) == 0
+		         && parsedigest( line + 5, &crc, digest ) ) {
+			sha256final( &image_sha, computed );
+			if( crc != image_crc || memcmp( digest, computed, 32 ) ) {
+				printe( 1, "ERROR image: inconsistent manifest\n" );
+				status |= EX_MISMATCH;
+			}
+		}
+		else {
+			printe( 1, "%s: line %d: invalid line\n", manifestfile, lineno );
+			status |= EX_MISMATCH;
+			break;
+		}
+	}
+	if( ferror( manifest ) ) {
+		printe( 1, "reading of the manifest (%s) failed (%s)\n",
+		  manifestfile, strerror( errno ) );
+		status |= EX_IO;
+	}
+	fclose( manifest );
+	if( status & (EX_MEM | EX_IO) ) {
+		free( verify.units );
+		return status;
+	}
+
+	/* Hash the image */
+	verify.fd = open( imgfile, O_RDONLY );
+	if( verify.fd < 0 ) {
+		printe( 1, "opening of the image file (%s) failed (%s)\n",
+		  imgfile, strerror( errno ) );
+		free( verify.units );
+		return status | EX_OPEN;
+	}
+	if( size >= 0 && fstat( verify.fd, &imgstat ) == 0
+	    && imgstat.st_size != (off_t)size * DVD_VIDEO_LB_LEN ) {
+		printe( 1, "ERROR image: size mismatch %lld != %lld\n",
+		  (long long)imgstat.st_size, (long long)size * DVD_VIDEO_LB_LEN );
+		status |= EX_MISMATCH;
+	}
+	pthread_mutex_init( &verify.lock, NULL );
+	for( i = 0; i < jobs; i++ ) {
+		rc = pthread_create( &threads[i], NULL, verifythread, &verify );
+		if( rc ) {
+			printe( 1, "creation of a worker failed (%s)\n", strerror( rc ) );
+			break;
+		}
+	}
+	if( i == 0 )
+		verifythread( &verify );
+	for( n = i, i = 0; i < n; i++ )
+		pthread_join( threads[i], NULL );
+	pthread_mutex_destroy( &verify.lock );
+	close( verify.fd );
+	free( verify.units );
+
+	status |= verify.status;
+	printe( 2, "%s: %d chunks verified%s\n", progname, verify.count,
+	  status ? "" : ", no error" );
+	return status;
+}
+
+/* Take units from the list and check them against the image */
+static void *verifythread( void *arg )
+{
+	verify_t      *verify = arg;
+	hashunit_t    *expected, unit;
+	unsigned char *buffer;
+	int           rc, status = EX_SUCCESS;
+
+	errno = posix_memalign( (void **)&buffer, BUFFER_ALIGN,
+	                        (size_t)batch * DVD_VIDEO_LB_LEN );
+	if( errno ) {
+		printe( 1, "memory allocation failed (%s)\n", strerror( errno ) );
+		status |= EX_MEM;
+		goto EXIT;
+	}
+
+	for( ; ; ) {
+		pthread_mutex_lock( &verify->lock );
+		expected = verify->next < verify->count ? &verify->units[verify->next++] : NULL;
+		pthread_mutex_unlock( &verify->lock );
+		if( ! expected ) break;
+
+		unit.start = expected->start;
+		unit.size = expected->size;
+		rc = hashfile( verify->fd, &unit, buffer );
+		status |= rc;
+		if( rc ) continue;
+		if( unit.crc != expected->crc || memcmp( unit.digest, expected->digest, 32 ) ) {
+			printe( 1, "ERROR sectors %d-%d: digest mismatch\n",
+			  unit.start, unit.start + unit.size );
+			status |= EX_MISMATCH;
+		}
+		else
+			printe( 3, "sectors %d-%d: ok\n", unit.start, unit.start + unit.size );
+	}
+
+	free( buffer );
+EXIT:
+	pthread_mutex_lock( &verify->lock );
+	verify->status |= status;
+	pthread_mutex_unlock( &verify->lock );
+	return NULL;
+}
+
+/* Parse the digests " crc32c sha256" of a line of the manifest; return the
+ * number of characters parsed (0 on error) */
+static int parsedigest( const char *line, uint32_t *crc, unsigned char *digest )
+{
+	unsigned int value;
+	int          pos = 0, i;
+
+	if( sscanf( line, " %8x %n", &value, &pos ) != 1 || pos == 0 )
+		return 0;
+	*crc = value;
+	for( i = 0; i < 32; i++, pos += 2 ) {
+		if( ! isxdigit( (unsigned char)line[pos] ) || ! isxdigit( (unsigned char)line[pos+1] )
+		    || sscanf( line + pos, "%2x", &value ) != 1 )
+			return 0;
+		digest[i] = (unsigned char)value;
+	}
+	return pos;
+}
+
+/* CRC-32C (Castagnoli) of len bytes, continuing crc (0 at the start); the
+ * crc32 instruction of SSE 4.2 is used when the processor has it */
+#if HAVE_CRC32C_SSE42
+__attribute__(( target( "sse4.2" ) ))
+static uint32_t crc32c_sse42( uint32_t crc, const unsigned char *p, size_t len )
+{
+	uint64_t c = ~crc, word;
+
+	for( ; len >= 8; len -= 8, p += 8 ) {
+		memcpy( &word, p, 8 );
+		c = _mm_crc32_u64( c, word );
+	}
+	for( ; len > 0; len--, p++ )
+		c = _mm_crc32_u8( (uint32_t)c, *p );
+	return ~(uint32_t)c;
+}
+#endif
+static uint32_t crc32c( uint32_t crc, const unsigned char *p, size_t len )
+{
+	const uint32_t *table;
+#if HAVE_CRC32C_SSE42
+	static int     sse42 = -1;
+
+	if( sse42 < 0 )
+		sse42 = __builtin_cpu_supports( "sse4.2" );
+	if( sse42 )
+		return crc32c_sse42( crc, p, len );
+#endif
+
+	/* Slicing by 8 */
+	table = crc32ctable( );
+	crc = ~crc;
+	for( ; len >= 8; len -= 8, p += 8 ) {
+		crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+		       | (uint32_t)p[3] << 24;
+		crc = table[7*256 + (crc & 0xff)] ^ table[6*256 + (crc >> 8 & 0xff)]
+		      ^ table[5*256 + (crc >> 16 & 0xff)] ^ table[4*256 + (crc >> 24)]
+		      ^ table[3*256 + p[4]] ^ table[2*256 + p[5]]
+		      ^ table[1*256 + p[6]] ^ table[p[7]];
+	}
+	for( ; len > 0; len--, p++ )
+		crc = table[(crc ^ *p) & 0xff] ^ crc >> 8;
+	return ~crc;
+}
+
+/* Tables of the slicing by 8 CRC-32C, computed once */
+static uint32_t       crc32c_table[8*256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static void crc32cinit( void )
+{
+	uint32_t c;
+	int      n, k;
+
+	for( n = 0; n < 256; n++ ) {
+		for( c = n, k = 0; k < 8; k++ )
+			c = c & 1 ? c >> 1 ^ CRC32C_POLY : c >> 1;
+		crc32c_table[n] = c;
+	}
+	for( n = 0; n < 256; n++ )
+		for( k = 1; k < 8; k++ )
+			crc32c_table[k*256 + n] = crc32c_table[(k-1)*256 + n] >> 8
+			                  ^ crc32c_table[crc32c_table[(k-1)*256 + n] & 0xff];
+}
+
+static const uint32_t *crc32ctable( void )
+{
+	pthread_once( &crc32c_once, crc32cinit );
+	return crc32c_table;
+}
+
+/* Multiply a and b modulo the CRC polynomial (a must not be 0) */
+static uint32_t multmodp( uint32_t a, uint32_t b )
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	for( ; ; ) {
+		if( a & m ) {
+			p ^= b;
+			if( (a & (m - 1)) == 0 )
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? b >> 1 ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* CRC-32C of the concatenation of two data of CRC-32C crc1 and crc2, the
+ * second one being len2 bytes long */
+static uint32_t crc32ccombine( uint32_t crc1, uint32_t crc2, long long len2 )
+{
+	uint32_t p = (uint32_t)1 << 31, x = (uint32_t)1 << 30; /* 1 and x */
+	int      k;
+
+	/* p = x^(8*len2) modulo the polynomial, x running over x^(2^k) */
+	for( k = 0; k < 3; k++ )
+		x = multmodp( x, x );
+	for( ; len2 > 0; len2 >>= 1, x = multmodp( x, x ) )
+		if( len2 & 1 )
+			p = multmodp( x, p );
+	return multmodp( p, crc1 ) ^ crc2;
+}
+
+/* SHA-256 (FIPS 180-4) */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR( x, n ) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256init( sha256_t *sha )
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy( sha->state, h0, sizeof( h0 ) );
+	sha->count = 0;
+}
+
+static void sha256update( sha256_t *sha, const unsigned char *p, size_t len )
+{
+	size_t used = sha->count % 64, n;
+
+	sha->count += len;
+	if( used ) {
+		n = 64 - used < len ? 64 - used : len;
+		memcpy( sha->buf + used, p, n );
+		p += n;
+		len -= n;
+		if( used + n < 64 ) return;
+		sha256block( sha, sha->buf );
+	}
+	for( ; len >= 64; len -= 64, p += 64 )
+		sha256block( sha, p );
+	memcpy( sha->buf, p, len );
+}
+
+static void sha256final( sha256_t *sha, unsigned char *digest )
+{
+	unsigned char pad[72] = { 0x80 };
+	uint64_t      bits = sha->count * 8;
+	size_t        n = 64 - (sha->count + 8) % 64;
+	int           i;
+
+	for( i = 0; i < 8; i++ )
+		pad[n + i] = (unsigned char)(bits >> (56 - 8*i));
+	sha256update( sha, pad, n + 8 );
+	for( i = 0; i < 32; i++ )
+		digest[i] = (unsigned char)(sha->state[i/4] >> (24 - 8*(i%4)));
+}
+
+static void sha256block( sha256_t *sha, const unsigned char *p )
+{
+	uint32_t w[64], s[8], t1, t2;
+	int      i;
+
+	for( i = 0; i < 16; i++ )
+		w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16
+		       | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+	for( ; i < 64; i++ )
+		w[i] = w[i-16] + (ROTR( w[i-15], 7 ) ^ ROTR( w[i-15], 18 ) ^ w[i-15] >> 3)
+		       + w[i-7] + (ROTR( w[i-2], 17 ) ^ ROTR( w[i-2], 19 ) ^ w[i-2] >> 10);
+
+	memcpy( s, sha->state, sizeof( s ) );
+	for( i = 0; i < 64; i++ ) {
+		t1 = s[7] + (ROTR( s[4], 6 ) ^ ROTR( s[4], 11 ) ^ ROTR( s[4], 25 ))
+		     + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		t2 = (ROTR( s[0], 2 ) ^ ROTR( s[0], 13 ) ^ ROTR( s[0], 22 ))
+		     + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove( s + 1, s, 7 * sizeof( uint32_t ) );
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for( i = 0; i < 8; i++ )
+		sha->state[i] += s[i];
+}
+
+/* Test for file existence before open (to silence libdvdnav) */
+dvd_file_t *openfile( dvd_reader_t *dvd, int title, dvd_read_domain_t domain )
+{
+	static dvd_stat_t stat;
+	if( ! DVDFileStat( dvd, title, domain, &stat ) )
+		return DVDOpenFile( dvd, title, domain );
+	return NULL;
+}
+
+/* Stat the title/domains with libdvdread in one pass, before the copy; only
+ * the VOBs it decrypts are opened afterwards */
+static void statfiles( dvd_reader_t *dvd )
+{
+	dvd_stat_t stat;
+	block_t    *block;
+	int        title, i;
+
+	for( title = 0; title < title_count && title < TITLE_MAX; title++ )
+		for( i = 0; i < DOMAIN_MAX; i++ ) {
+			block = domainblock( &dvdread_blocks[title], dvd_read_domains[i] );
+			block->start = 0;
+			block->size = DVDFileStat( dvd, title, dvd_read_domains[i], &stat ) < 0 ?
+			              -1 : (int)(stat.size / DVD_VIDEO_LB_LEN);
+		}
+}
+
+/* Seconds since the start (0 if the metrics are not printed) */
+static double statnow( void )
+{
+	struct timespec now;
+
+	if( ! stats )
+		return 0;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (now.tv_sec - metrics.start.tv_sec)
+	       + (now.tv_nsec - metrics.start.tv_nsec) / 1e9;
+}
+
+/* Count calls of an operation and the bytes transferred; the amount of data
+ * read or copied so far is printed at most once per second */
+static void statcount( int op, int calls, long long bytes )
+{
+	long long moved;
+	double    t;
+
+	if( ! stats )
+		return;
+	pthread_mutex_lock( &count_lock );
+	metrics.calls[op] += calls;
+	metrics.bytes[op] += bytes;
+	if( bytes && (op == OP_READ || op == OP_COPY)
+	    && (t = statnow( )) - metrics.last >= 1 ) {
+		moved = metrics.bytes[OP_READ] + metrics.bytes[OP_COPY];
+		fprintf( stats, "{\"event\": \"progress\", \"seconds\": %.3f, \"bytes\": %lld, "
+		  "\"mb_per_s\": %.1f, \"avg_mb_per_s\": %.1f}\n", t, moved,
+		  (moved - metrics.last_bytes) / (t - metrics.last) / 1e6, moved / t / 1e6 );
+		metrics.last = t;
+		metrics.last_bytes = moved;
+	}
+	pthread_mutex_unlock( &count_lock );
+}
+
+/* Add seconds to a phase; the phases of the main thread are printed */
+static void statphase( int phase, double seconds )
+{
+	if( ! stats )
+		return;
+	pthread_mutex_lock( &count_lock );
+	metrics.phases[phase] += seconds;
+	if( phase == PH_OPEN || phase == PH_LOCATE || phase == PH_COPY || phase == PH_CLOSE )
+		fprintf( stats, "{\"event\": \"phase\", \"name\": \"%s\", \"seconds\": %.3f}\n",
+		  phasenames[phase], seconds );
+	pthread_mutex_unlock( &count_lock );
+}
+
+/* Print the throughput of the copy of a sector range started at time t0, and
+ * add its duration to the titles or the gaps */
+static void statextent( const char *name, int start, int sectors, int gap, double t0 )
+{
+	long long moved;
+	double    t, dt;
+
+	if( ! stats || sectors <= 0 )
+		return;
+	t = statnow( );
+	dt = t - t0;
+	pthread_mutex_lock( &count_lock );
+	metrics.phases[gap ? PH_GAPS : PH_TITLES] += dt;
+	moved = metrics.bytes[OP_READ] + metrics.bytes[OP_COPY];
+	fprintf( stats, "{\"event\": \"extent\", \"name\": \"%s\", \"start\": %d, "
+	  "\"sectors\": %d, \"seconds\": %.3f, \"mb_per_s\": %.1f, \"avg_mb_per_s\": %.1f}\n",
+	  name, start, sectors, dt, dt > 0 ? (double)sectors * DVD_VIDEO_LB_LEN / dt / 1e6 : 0,
+	  t > 0 ? moved / t / 1e6 : 0 );
+	pthread_mutex_unlock( &count_lock );
+}
+
+/* Print the result of a job of the batch mode */
+static void statjob( int i, const job_t *job, int size, double seconds )
+{
+	if( ! stats )
+		return;
+	fprintf( stats, "{\"event\": \"job\", \"job\": %d, \"dvd\": ", i+1 );
+	statstring( job->dvdfile );
+	fprintf( stats, ", \"file\": " );
+	statstring( job->imgfile );
+	fprintf( stats, ", \"status\": %d, \"sectors\": %d, \"seconds\": %.3f, "
+	  "\"mb_per_s\": %.1f}\n", job->status, size, seconds,
+	  seconds > 0 ? (double)size * DVD_VIDEO_LB_LEN / seconds / 1e6 : 0 );
+}
+
+/* Print a string (a file name) as a JSON string */
+static void statstring( const char *s )
+{
+	fputc( '"', stats );
+	for( ; *s; s++ )
+		if( *s == '"' || *s == '\\' )
+			fprintf( stats, "\\%c", *s );
+		else if( (unsigned char)*s < 0x20 )
+			fprintf( stats, "\\u%04x", *s );
+		else
+			fputc( *s, stats );
+	fputc( '"', stats );
+}
+
+/* Print the totals of the run */
+static void statsummary( int size, int status )
+{
+	double t;
+	int    i;
+
+	if( ! stats )
+		return;
+	t = statnow( );
+	fprintf( stats, "{\"event\": \"summary\", \"seconds\": %.3f, \"sectors\": %d, "
+	  "\"status\": %d, \"avg_mb_per_s\": %.1f, \"phases\": {", t, size, status,
+	  t > 0 ? (metrics.bytes[OP_READ] + metrics.bytes[OP_COPY]) / t / 1e6 : 0 );
+	for( i = 0; i < PH_MAX; i++ )
+		fprintf( stats, "%s\"%s\": %.3f", i ? ", " : "", phasenames[i], metrics.phases[i] );
+	fprintf( stats, "}, \"calls\": {" );
+	for( i = 0; i < OP_MAX; i++ )
+		fprintf( stats, "%s\"%s\": %lld", i ? ", " : "", opnames[i], metrics.calls[i] );
+	fprintf( stats, "}, \"bytes\": {" );
+	for( i = 0; i < OP_MAX; i++ )
+		fprintf( stats, "%s\"%s\": %lld", i ? ", " : "", opnames[i], metrics.bytes[i] );
+	fprintf( stats, "}}\n" );
+	fclose( stats );
+}
+
+/* Percentage of a block of size sectors done up to lb, kept below 100 so
+ * that only the final progress( 100 ) finishes the line */
+static int percent( int lb, int size )
+{
+	int perc = (int)((long long)lb*100/size);
+	return perc < 99 ? perc : 99;
+}
+
 /* Keep a percentage indicator at the end of the line */
 static int progress( const int perc )
 {
 	static int last = 0;
+	if( progress_off ) /* concurrent workers */
+		return 0;
 	if( perc >= 101 ) { /* abort */
 		last = 0;
 		printe( 2, "\n" );
@@ -619,7 +4206,7 @@ int printe( const char level, const char *format, ... )
 {
 	va_list arg;
 	int     ret;
-	FILE   *stream = stdout;
+	FILE   *stream = msg_stderr ? stderr : stdout;
 	if( level <= 1 )
 		stream = stderr;
 	if( level > verbosity )
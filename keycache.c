@@ -0,0 +1,157 @@
+/* keycache.c - cache of the title keys of libdvdcss, one directory per DVD
+ * Copyright © 2026 Géraud Meyer <graud@gmx.com>
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 2 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *   for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <dvdcss/dvdcss.h>
+
+#include "keycache.h"
+
+#define FINGERPRINT_START 16 /* volume and file system descriptors */
+#define FINGERPRINT_SECTORS 256
+char *keycache = NULL;
+int  keys_cached = 0, keys_searched = 0;
+double keys_saved = 0, keys_time = 0;
+
+/* Make libdvdcss keep the title keys in a directory of cachedir proper to the
+ * DVD, named after a hash of its volume and file system descriptors; return
+ * 0, or -1 with errno set */
+int opencache( const char *cachedir, const char *dvdfile )
+{
+	unsigned char      sector[DVDCSS_BLOCK_SIZE];
+	unsigned long long hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+	ssize_t            rc;
+	int                dvd, lb, i;
+
+	dvd = open( dvdfile, O_RDONLY );
+	if( dvd < 0 )
+		return -1;
+	for( lb = FINGERPRINT_START; lb < FINGERPRINT_START+FINGERPRINT_SECTORS; lb++ ) {
+		rc = pread( dvd, sector, DVDCSS_BLOCK_SIZE, (off_t)lb * DVDCSS_BLOCK_SIZE );
+		if( rc != DVDCSS_BLOCK_SIZE ) {
+			if( rc >= 0 ) errno = EIO;
+			close( dvd );
+			return -1;
+		}
+		for( i = 0; i < DVDCSS_BLOCK_SIZE; i++ ) {
+			hash ^= sector[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	close( dvd );
+
+	keycache = malloc( strlen( cachedir ) + 18 );
+	if( ! keycache )
+		return -1;
+	sprintf( keycache, "%s/%016llx", cachedir, hash );
+	if( (mkdir( cachedir, S_IRWXU ) < 0 && errno != EEXIST)
+	    || (mkdir( keycache, S_IRWXU ) < 0 && errno != EEXIST)
+	    || setenv( "DVDCSS_CACHE", keycache, 1 ) < 0 ) {
+		i = errno;
+		free( keycache );
+		keycache = NULL;
+		errno = i;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Get the title key of the title/domain starting at sector (like dvdcss_seek()
+ * with DVDCSS_SEEK_KEY), keeping count of the use of the key cache; *t is set
+ * to the time taken */
+int seekkey( dvdcss_t dvdcss, int sector, double *t )
+{
+	struct timespec start, end;
+	int             cached, rc;
+
+	cached = keycache ? keycached( sector ) : 0;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	rc = dvdcss_seek( dvdcss, sector, DVDCSS_SEEK_KEY );
+	clock_gettime( CLOCK_MONOTONIC, &end );
+	*t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if( rc < 0 || ! keycache )
+		return rc;
+
+	if( cached ) {
+		keys_cached++;
+		keys_saved += keytime( sector, -1 );
+	}
+	else {
+		keys_searched++;
+		keys_time += *t;
+		keytime( sector, *t );
+	}
+	return rc;
+}
+
+/* Check if libdvdcss has the title key of sector in its cache, that is in a
+ * subdirectory of keycache (named after the disc) */
+int keycached( int sector )
+{
+	DIR           *dir;
+	struct dirent *entry;
+	struct stat   buf;
+	char          path[4096];
+	int           found = 0;
+
+	dir = opendir( keycache );
+	if( ! dir )
+		return 0;
+	while( ! found && (entry = readdir( dir )) ) {
+		if( entry->d_name[0] == '.' )
+			continue;
+		snprintf( path, sizeof( path ), "%s/%s/%.10x", keycache, entry->d_name, sector );
+		found = stat( path, &buf ) == 0;
+	}
+	closedir( dir );
+
+	return found;
+}
+
+/* Record the time t taken to search the title key of sector in the file times
+ * of keycache, or if t is negative return the time recorded */
+double keytime( int sector, double t )
+{
+	FILE   *times;
+	char   path[4096];
+	int    s;
+	double u;
+
+	snprintf( path, sizeof( path ), "%s/times", keycache );
+	times = fopen( path, t < 0 ? "r" : "a" );
+	if( ! times )
+		return 0;
+	if( t >= 0 )
+		fprintf( times, "%d %f\n", sector, t );
+	else
+		for( t = 0; fscanf( times, "%d %lf\n", &s, &u ) == 2; )
+			if( s == sector ) t = u;
+	fclose( times );
+
+	return t;
+}
@@ -0,0 +1,30 @@
+/* keycache.h - cache of the title keys of libdvdcss, one directory per DVD
+ * Copyright © 2026 Géraud Meyer <graud@gmx.com>
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 2 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *   for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYCACHE_H
+#define KEYCACHE_H
+
+#include <dvdcss/dvdcss.h>
+
+extern char *keycache; /* libdvdcss' cache directory for this DVD */
+extern int  keys_cached, keys_searched;
+extern double keys_saved, keys_time; /* seconds */
+
+int    opencache( const char *, const char * );
+int    seekkey  ( dvdcss_t, int, double * );
+int    keycached( int );
+double keytime  ( int, double );
+
+#endif